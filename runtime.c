@@ -246,17 +246,24 @@ int memcpy(char *dest, char *src, int n) {
     return dest;
 }
 
-/* Utility functions */
+/* Utility functions - written as if/else assignments, which the
+ * enhanced compiler lowers to a conditional move instead of a branch */
 int abs(int n) {
-    return n < 0 ? -n : n;
+    int r;
+    if (n < 0) r = -n; else r = n;
+    return r;
 }
 
 int min(int a, int b) {
-    return a < b ? a : b;
+    int r;
+    if (a < b) r = a; else r = b;
+    return r;
 }
 
 int max(int a, int b) {
-    return a > b ? a : b;
+    int r;
+    if (a > b) r = a; else r = b;
+    return r;
 }
 
 /* Simple atoi */
@@ -286,8 +293,63 @@ int atoi(char *s) {
     return neg ? -n : n;
 }
 
+/* Profile output for programs compiled with -fprofile-generate. Each
+ * instrumented unit registers its counter table when its first function
+ * runs, and an instrumented main returns through exit, which calls
+ * _prof_dump to write one line per counter of every table to scc.prof:
+ *   function kind id count
+ * with kind B for a block, T and N for the taken and not-taken edges
+ * of a conditional branch. A table starts with the link to the next
+ * one and a registered flag. */
+int *_prof_tab;
+
+int _prof_register(int *tab) {
+    tab[0] = _prof_tab;
+    tab[1] = 1;
+    _prof_tab = tab;
+    return 0;
+}
+
+int _prof_putn(int n, int fd) {
+    if (n >= 10) {
+        _prof_putn(n / 10, fd);
+    }
+    fputc(n % 10 + '0', fd);
+    return 0;
+}
+
+int _prof_dump() {
+    int *tab;
+    int *count;
+    int n;
+    int i;
+    int fd;
+    
+    if (!_prof_tab) return 0;
+    fd = creat("scc.prof");
+    if (fd < 0) return -1;
+    for (tab = _prof_tab; tab; tab = tab[0]) {
+        n = tab[2];
+        count = tab[3];
+        for (i = 0; i < n; i++) {
+            fputs(tab[4 + 3 * i], fd);
+            fputc(' ', fd);
+            fputc(tab[5 + 3 * i], fd);
+            fputc(' ', fd);
+            _prof_putn(tab[6 + 3 * i], fd);
+            fputc(' ', fd);
+            _prof_putn(count[i], fd);
+            fputc('\n', fd);
+        }
+    }
+    close(fd);
+    _prof_tab = 0;
+    return 0;
+}
+
 /* Exit function */
 int exit(int code) {
+    _prof_dump();
     _sys_exit(code);
     return 0;  /* Never reached */
 }
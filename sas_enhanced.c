@@ -903,12 +903,19 @@ void process_directive(char *directive, char *args) {
         char *p = args;
         p = get_token(p, name);
         add_symbol(name, 0, -1, SYM_EXTERN);
-    } else if (streq(directive, ".align")) {
+    } else if (streq(directive, ".align") || streq(directive, ".balign") ||
+               streq(directive, ".p2align")) {
+        /* Pad to the boundary, and make the section at least as aligned
+         * as anything placed in it so the linker keeps the boundary */
         char *p = args;
         int align = eval_expr(&p);
+        if (streq(directive, ".p2align")) align = 1 << align;
         while (section_sizes[current_section] & (align - 1)) {
             emit_byte(0);
         }
+        if (align > section_aligns[current_section]) {
+            section_aligns[current_section] = align;
+        }
     } else if (streq(directive, ".byte") || streq(directive, ".db")) {
         char *p = args;
         while (*p) {
@@ -0,0 +1,212 @@
+/* scc_driver.c - Compile, assemble and link Small-C programs in one step
+ *
+ *   scc-driver [-o prog] [-L dir] [compiler options] a.c b.c ...
+ *
+ * Runs the stages of scc-build.sh in one process and passes their output
+ * in memory: sppe preprocesses each source into a buffer, scc_enhanced
+ * compiles the buffers (as one -whole program when there are several)
+ * into a memory file, as encodes that into another, and sld_enhanced
+ * links it with the runtime. Only the program is written to disk.
+ *
+ * The tools are compiled in here with their main and the names they
+ * share renamed. sas_enhanced knows too few instructions for the
+ * compiler's output and writes its own object format, not ELF, so the
+ * assembler is GNU as, the one process started per build. Memory files
+ * and /proc/self/fd make this Linux only.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Sources preprocessed by sppe, which scc_enhanced opens by name */
+struct unit {
+    char *name;
+    char *text;
+    size_t len;
+} *units;
+int nunits;
+
+FILE *unit_open(const char *name, const char *mode) {
+    int i;
+    for (i = 0; i < nunits; i++) {
+        if (!strcmp(units[i].name, name)) return fmemopen(units[i].text, units[i].len, mode);
+    }
+    return fopen(name, mode);
+}
+
+/* The compiler */
+#define main scc_main
+#define fopen unit_open
+#include "scc_enhanced.c"
+#undef fopen
+#undef main
+
+/* The preprocessor, written for the Small-C runtime: fputs and fputc
+ * take a file descriptor, and what goes to 1 is the preprocessed unit */
+FILE *pp_out;
+
+int pp_fputs(char *s, int fd) {
+    return fputs(s, fd == 1 ? pp_out : stderr);
+}
+
+int pp_fputc(int c, int fd) {
+    return fputc(c, fd == 1 ? pp_out : stderr);
+}
+
+int pp_puts(char *s) {
+    fputs(s, stderr);
+    return fputc('\n', stderr);
+}
+
+#define main sppe_main
+#define error sppe_error
+#define filename sppe_filename
+#define fputs pp_fputs
+#define fputc pp_fputc
+#define puts pp_puts
+#undef NULL
+#include "sppe.c"
+#undef NULL
+#define NULL ((void *)0)
+#undef puts
+#undef fputc
+#undef fputs
+#undef filename
+#undef error
+#undef main
+
+/* The linker */
+#define main sld_main
+#define add_string sld_add_string
+#define add_symbol sld_add_symbol
+#define find_symbol sld_find_symbol
+#define creat(path) creat(path, 0755)
+#include "sld_enhanced.c"
+#undef creat
+#undef find_symbol
+#undef add_symbol
+#undef add_string
+#undef main
+
+void driver_usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-o output] [-L dir] [compiler options] source.c...\n", prog);
+    fprintf(stderr, "       -L dir: where runtime.o and the syscall object are (default .)\n");
+}
+
+/* A memory file and the path other code can open it by */
+int mem_file(char *name, char *path) {
+    int fd = memfd_create(name, 0);
+    if (fd < 0) {
+        perror("memfd_create");
+        exit(1);
+    }
+    sprintf(path, "/proc/self/fd/%d", fd);
+    return fd;
+}
+
+/* Run as on the assembly in asm_fd, writing the object to obj */
+int assemble(int asm_fd, char *obj) {
+    int pid, status;
+
+    lseek(asm_fd, 0, SEEK_SET);
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(asm_fd, 0);
+        execlp("as", "as", "-o", obj, (char *)NULL);
+        perror("as");
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Error: as failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char **cc_argv = malloc((argc + 2) * sizeof(char *));
+    char *program = "a.out", *lib = ".", *pp_argv[3];
+    char asm_path[32], obj_path[32], syscall_obj[512], runtime_obj[512];
+    char *ld_argv[7];
+    struct function *main_func;
+    int i, ncc = 1, asm_fd, stdout_fd, arm64 = 0;
+
+#ifdef __aarch64__
+    arm64 = 1;
+#endif
+    units = malloc(argc * sizeof(struct unit));
+    cc_argv[0] = "scc_enhanced";
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            program = argv[++i];
+        } else if (!strcmp(argv[i], "-L") && i + 1 < argc) {
+            lib = argv[++i];
+        } else if (argv[i][0] == '-') {
+            if (!strcmp(argv[i], "-arm64")) arm64 = 1;
+            if (!strcmp(argv[i], "-x64")) arm64 = 0;
+            cc_argv[ncc++] = argv[i];
+        } else {
+            units[nunits++].name = argv[i];
+        }
+    }
+    if (!nunits) {
+        driver_usage(argv[0]);
+        return 1;
+    }
+
+    /* Preprocess every source into memory */
+    for (i = 0; i < nunits; i++) {
+        pp_out = open_memstream(&units[i].text, &units[i].len);
+        pp_argv[0] = "sppe";
+        pp_argv[1] = units[i].name;
+        pp_argv[2] = NULL;
+        if (sppe_main(2, pp_argv)) return 1;
+        fclose(pp_out);
+    }
+
+    /* Compile them, with the assembly going to a memory file */
+    if (nunits > 1) cc_argv[ncc++] = "-whole";
+    for (i = 0; i < nunits; i++) cc_argv[ncc++] = units[i].name;
+    asm_fd = mem_file("scc-driver.s", asm_path);
+    fflush(stdout);
+    stdout_fd = dup(1);
+    dup2(asm_fd, 1);
+    if (scc_main(ncc, cc_argv)) return 1;
+    fflush(stdout);
+    dup2(stdout_fd, 1);
+    close(stdout_fd);
+    main_func = lookup_func("main");
+    if (!main_func || !main_func->defined) {
+        fprintf(stderr, "Error: main function not defined\n");
+        return 1;
+    }
+
+    /* Assemble, and link with the runtime */
+    mem_file("scc-driver.o", obj_path);
+    if (assemble(asm_fd, obj_path) < 0) return 1;
+    snprintf(syscall_obj, sizeof(syscall_obj), "%s/syscall_linux_%s.o", lib,
+             arm64 ? "arm64" : "x64");
+    snprintf(runtime_obj, sizeof(runtime_obj), "%s/runtime.o", lib);
+    ld_argv[0] = "sld_enhanced";
+    ld_argv[1] = "-o";
+    ld_argv[2] = program;
+    ld_argv[3] = syscall_obj;
+    ld_argv[4] = runtime_obj;
+    ld_argv[5] = obj_path;
+    ld_argv[6] = NULL;
+    return sld_main(6, ld_argv);
+}
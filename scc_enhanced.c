@@ -16,8 +16,31 @@
  * - Local variable initialization
  * - Improved code generation
  * - Better handling of character literals
- * - Comments (// and /* */)
+ * - Comments (// and block)
  * - Compound assignment operators
+ * - Deduplicated, read-only string literal pool
+ * - Local value numbering of array element addresses and loads
+ * - Branchless cmov/csel lowering of if/else assignments
+ * - Builtin strlen/abs/min/max/memset/memcpy, printf format specialization
+ * - Inline asm statements with register-bound operands
+ * - Bit-manipulation and atomic intrinsics
+ * - 128-bit vchar16/vint2 vector types lowered to SSE2 and NEON
+ * - Structs with natural alignment, . and -> field access, sizeof
+ * - __aligned(N) on global and local declarations
+ * - const globals and brace-initialized tables in .rodata
+ * - Two-dimensional row-major arrays
+ * - Block-scoped locals; sibling blocks share stack slots
+ * - Whole-program mode: cross-unit inlining, dead function removal and
+ *   propagation of never-written globals
+ * - Block and edge counters for profiling, -fprofile-generate
+ * - Profile-guided block layout and hot/cold splitting, -fprofile-use
+ * - Compile-time statistics per phase and table, -stats
+ * - Source-annotated assembly with .loc directives, -annotate
+ * - .type/.size and CFI unwind directives on every function, line
+ *   tables with -g
+ * - Stack usage per function, -fstack-usage and -fstack-size-section
+ * - Arena allocation; names, lines and tables have no fixed limits
+ * - Each unit lexed once into a token array the parser can move through
  * 
  * Still maintains the simplicity and self-bootstrapping capability
  */
@@ -26,16 +49,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
 
-/* Configuration */
-#define NAMESIZE 32
-#define MAXARGS 8
-#define MAXLOCALS 32
-#define MAXGLOBALS 200
-#define MAXWHILE 20
-#define MAXSTRING 2048
-#define LINESIZE 256
-#define MAXFUNCS 100
+/* Configuration; the tables grow as needed (see the arenas below) */
+#define MAXARGS 16          /* parameters of a function */
+#define STRHASH 64
+#define NAMEHASH 1024       /* buckets for global and function names */
+#define MAXVN 8
+#define MAXASMOPS 10        /* asm operands are %0 to %9 */
+#define NHOTLINES 10
+#define ARENA_BLOCK 65536
 
 /* Target architecture */
 enum { TARGET_X64, TARGET_ARM64 };
@@ -46,66 +71,362 @@ enum {
     T_EOF = -1, T_INT = 256, T_CHAR, T_IF, T_ELSE, T_WHILE, T_FOR,
     T_RETURN, T_BREAK, T_CONTINUE, T_IDENT, T_NUMBER, T_STRING,
     T_EQ, T_NE, T_LE, T_GE, T_SHL, T_SHR, T_AND, T_OR, T_INC, T_DEC,
-    T_PLUSEQ, T_MINUSEQ, T_STAREQ, T_SLASHEQ, T_CHARLIT
+    T_PLUSEQ, T_MINUSEQ, T_STAREQ, T_SLASHEQ, T_CHARLIT, T_ASM,
+    T_VCHAR16, T_VINT2, T_STRUCT, T_SIZEOF, T_ARROW, T_CONST
 };
 
 /* Symbol table entry */
 struct symbol {
-    char name[NAMESIZE];
-    int type;       /* 0=int, 1=char, 2=int*, 3=char* */
+    char *name;
+    int type;       /* 0=int, 1=char, 2=int*, 3=char*, VCHAR16, VINT2,
+                       STRUCTOBJ, STRUCTPTR */
     int offset;     /* stack offset for locals, label for globals */
     int isarray;
-    int size;       /* array size */
+    int size;       /* array size, all elements of a 2-D array */
+    int cols;       /* 2-D arrays: elements per row, 0 otherwise */
     int isparam;    /* is function parameter */
+    int addrtaken;  /* address escapes via & */
+    int tag;        /* STRUCTOBJ, STRUCTPTR: index in structs[] */
+    int align;      /* __aligned(N), 0 if none */
+    int isconst;    /* const object: stores are rejected */
+    int written;    /* globals: stored to somewhere in the program */
+    int value;      /* scalar globals: initial value */
+    int next;       /* globals: next in the hash chain, -1 at end */
+};
+
+/* String literal pool entry */
+struct strlit {
+    int offset;     /* start of text in strpool */
+    int len;        /* length without terminating NUL */
+    int label;      /* emitted as S<label> */
+    int refs;       /* uses left in the code; unused literals are dropped */
+    int next;       /* next entry in hash chain, -1 at end */
+};
+
+/* 128-bit vector types: 16 byte lanes, or 2 int lanes; structs and
+ * pointers to them */
+enum { VCHAR16 = 4, VINT2 = 5, STRUCTOBJ, STRUCTPTR };
+
+/* Struct type: fields are fields[first .. first+nfields) */
+struct structdef {
+    char *name;
+    int defined;
+    int size;       /* padded to a multiple of align */
+    int align;
+    int first;
+    int nfields;
+};
+
+struct field {
+    char *name;
+    int type;       /* symbol type */
+    int tag;        /* STRUCTOBJ, STRUCTPTR: index in structs[] */
+    int count;      /* array length, 0 if not an array */
+    int offset;
+};
+
+/* Operand that one instruction sequence loads into the accumulator */
+enum { OP_NONE, OP_CONST, OP_VAR, OP_ADDR, OP_STR };
+struct operand {
+    int kind;
+    int val;                /* OP_CONST, OP_STR: label of the literal */
+    struct symbol *sym;     /* OP_VAR: variable value, OP_ADDR: array base */
+};
+
+/* Value-numbered array element: base[index] with both operands simple */
+struct vnentry {
+    int valid;
+    int age;
+    struct operand base;
+    struct operand index;
+    int areg;       /* register holding the element address */
+    int vreg;       /* register holding the loaded element, -1 if none */
+    int asave;      /* code index of the copy into areg, -1 once reused */
+    int vsave;      /* code index of the copy into vreg, -1 once reused */
 };
 
 /* Function table entry */
 struct function {
-    char name[NAMESIZE];
+    char *name;
     int defined;
     int nparams;
     int param_types[MAXARGS];
+    int text_start;     /* -whole: body in wholetext[text_start, text_end) */
+    int text_end;
+    int insns;          /* instructions emitted, for -stats */
+    int frame;          /* bytes of stack used, calls not counted */
+    int live;           /* -whole: 1 reachable from main, 2 once scanned */
+    int next;           /* next in the hash chain, -1 at end */
+};
+
+/* -fprofile-generate: one counter. kind is 'B' for a block, 'T' and 'N'
+ * for the taken and not-taken edges of a conditional branch; id numbers
+ * them in code order within the function. */
+struct profrec {
+    char *func;
+    int kind;
+    int id;
+    long count;         /* -fprofile-use: the count read back */
+    int next;           /* -fprofile-use: first record of the next function
+                         * in the hash chain, -1 at end */
+};
+
+/*
+ * Token stream: a unit is lexed in one pass into parallel arrays before
+ * it is parsed, so the parser can look any distance ahead and go back to
+ * an earlier token without lexing again. text is the offset of the
+ * spelling of identifiers, keywords and strings in pool, -1 for other
+ * tokens; off is where the token starts in src, for error messages.
+ */
+struct tokstream {
+    int *kind;
+    int *value;     /* T_NUMBER, T_CHARLIT: the value; T_STRING: the length */
+    int *line;      /* NULL: the tokens take the line they are used on */
+    int *off;
+    int *text;
+    int n, cap;
+    char *src;
+    char *pool;
+    int poolsize;
+};
+
+/* -whole: function whose body is  return expr;  kept as tokens so
+ * calls in any unit can be expanded in place */
+struct inlinefn {
+    char *name;
+    int nparams;
+    char *params[MAXARGS];
+    int ptypes[MAXARGS];
+    struct tokstream body;  /* the expression and its ; */
+};
+
+/*
+ * Arenas: memory is handed out by bumping a pointer through large blocks
+ * and given back in bulk. perm_arena holds what lives as long as the
+ * program, unit_arena what belongs to one source file and func_arena
+ * what belongs to the function being compiled. A table grows by moving
+ * to twice the room in its arena, leaving the old copy to be reclaimed
+ * with the arena; symbols and functions are pointed at, so those tables
+ * hold pointers and the entries themselves never move.
+ */
+struct arenablock {
+    struct arenablock *prev;
+    size_t size;            /* bytes of data after the header */
+};
+
+struct arena {
+    struct arenablock *block;
+    size_t used;
 };
 
+struct arena perm_arena, unit_arena, func_arena;
+
 /* Global state */
-char line[LINESIZE] = {0};
-char *lptr = line;
+char *lptr = "";        /* the lexer's position in the unit source */
 int lineno = 1;
 int token = T_EOF;
 int tokval = 0;
-char tokstr[NAMESIZE] = {0};
+int toklen = 0;     /* length of T_STRING text, may contain NULs */
+char *tokstr = "";
+struct tokstream unit_tokens;           /* in unit_arena */
+struct tokstream *ts = &unit_tokens;    /* the stream being parsed */
+int tokpos = 0;                         /* index of the token after token */
 FILE *input = NULL;
 char *filename = NULL;
 
 /* Symbol tables */
-struct symbol globals[MAXGLOBALS];
-int nglobals = 0;
-struct symbol locals[MAXLOCALS];
-int nlocals = 0;
+struct symbol **globals = NULL;
+int nglobals = 0, maxglobals = 0;
+int globhash[NAMEHASH];     /* chains through symbol.next */
+struct symbol **locals = NULL;  /* in func_arena */
+int nlocals = 0, maxlocals = 0;
 int sp = 0;  /* stack pointer offset */
+int lsp = 0;            /* offset of the lowest live local */
+int lsp_min = 0;        /* lowest lsp in the function: the frame size */
+int scope_first = 0;    /* first local of the innermost block */
 int param_offset = 16;  /* parameter offset from frame pointer */
+int frame_sp = 0;       /* sp at the 16-byte aligned bottom of the frame */
+int use_builtins = 1;   /* expand runtime helpers inline, -fno-builtin */
+int use_popcnt = 1;     /* popcnt on x64, off with -mbaseline */
+int use_lzcnt = 0;      /* lzcnt on x64, -mlzcnt */
+int use_tzcnt = 0;      /* tzcnt on x64, -mbmi */
+int infunc = 0;         /* declarations go to the locals table */
+int inparams = 0;       /* declarations are parameters */
+
+/* Whole-program mode: all units go to one output, and function bodies
+ * are held back until every unit is parsed */
+int whole = 0;
+char *wholetext = NULL;
+int wholelen = 0, maxwhole = 0;
+int whole_asm = 0;      /* an asm statement may name anything */
+struct inlinefn *inlines = NULL;
+int ninlines = 0, maxinlines = 0;
+int inline_depth = 0;
+int lookup_floor = 0;   /* lowest visible local; inlined bodies see only
+                         * their parameters */
+
+/* Profile instrumentation: the counters of the whole output */
+int profile_gen = 0;    /* -fprofile-generate */
+struct profrec *profrecs = NULL;
+int nprof = 0, maxprof = 0;
+int profile_use = 0;    /* -fprofile-use: profrecs holds the counts */
+long profile_max = 0;   /* the largest count in the profile */
+int profhash[NAMEHASH]; /* chains the first record of each function */
+int prof_lo = 0, prof_hi = 0;   /* the records of curfunc */
+
+/* -stats: wall time is charged to one phase at a time; parse is the
+ * default and covers everything not charged elsewhere */
+enum { PH_PARSE, PH_PRESCAN, PH_LEX, PH_LOOKUP, PH_EMIT, PH_OUTPUT, NPHASES };
+char *phase_names[NPHASES] = {"parse", "prescan", "lex", "lookup", "emit", "output"};
+int stats = 0;          /* 1 for text, 2 for JSON */
+int phase = PH_PARSE;
+double phase_t0 = 0;
+double stat_time[NPHASES];
+long stat_tokens = 0;
+long stat_lookups = 0;
+long stat_probes = 0;
+long stat_maxprobe = 0;
+long stat_insns = 0;
+long stat_symbols = 0;
+long out_bytes = 0;
+int peak_locals = 0, peak_code = 0, peak_loops = 0;
+int peak_maxlocals = 0, peak_maxcode = 0;     /* capacities before a reset */
+
+/* -annotate: the source of the unit being compiled, and the lines that
+ * cost the most instructions so far */
+struct hotline {
+    char *file;
+    char *func;
+    int line;
+    int insns;
+};
+
+int annotate = 0;
+int debug_lines = 0;    /* -g: .file and .loc without the comments */
+int unitno = 0;         /* .file number of the unit */
+char *srctext = NULL;   /* in unit_arena */
+int *srcoff = NULL;
+int nsrclines = 0;
+int *lineinsns = NULL;  /* per line 0..nsrclines + 1 */
+struct hotline hotlines[NHOTLINES];
+int nhotlines = 0;
+
+/* -fstack-usage: report of the frame sizes; -fstack-size-section: the
+ * same sizes in .stack_sizes, for sstack to add up along the call graph */
+FILE *stack_report = NULL;
+int stack_section = 0;
+
+/* Struct types */
+struct structdef *structs = NULL;
+int nstructs = 0, maxstructs = 0;
+struct field *fields = NULL;
+int nfields = 0, maxfields = 0;
 
 /* Function table */
-struct function functions[MAXFUNCS];
-int nfuncs = 0;
-char curfunc[NAMESIZE];
+struct function **functions = NULL;
+int nfuncs = 0, maxfuncs = 0;
+int funchash[NAMEHASH];
+char *curfunc = "";
 
 /* Control flow */
-int breaklab[MAXWHILE];
-int contlab[MAXWHILE];
-int wsp = 0;
+int *breaklab = NULL;
+int *contlab = NULL;
+int wsp = 0, maxwhile = 0;
 int lab = 1;
 
-/* String pool */
-char strpool[MAXSTRING];
-int strptr = 0;
+/* String pool: literals are deduplicated here and emitted once, read-only */
+char *strpool = NULL;
+int strptr = 0, maxstring = 0;
+struct strlit *strlits = NULL;
+int nstrlits = 0, maxstrlits = 0;
+int strhash[STRHASH];
+
+/* Code buffer: the current function body is collected here so it can be
+ * rewritten before it is written out; the rows are in func_arena */
+char **code = NULL;
+int ncode = 0, maxcode = 0;
+int *codeline = NULL;   /* -annotate: source line of each row */
+int keep_line = 0;      /* re-emitted rows keep their line, not lineno */
+int buffering = 0;
+
+/* Lvalue left by primary()/postfix(); the load is deferred so the same
+ * parse can be used as a store target */
+enum { LV_NONE, LV_VAR, LV_MEM, LV_FIELD };
+int lval = LV_NONE;
+struct symbol *lvsym = NULL;    /* LV_VAR: the variable, LV_FIELD: the struct */
+int lvdisp = 0;                 /* LV_MEM, LV_FIELD: displacement in bytes */
+int lvwidth = 8;                /* LV_MEM, LV_FIELD: 8, or 1 for char */
+int lvvn = -1;                  /* LV_MEM: value-number entry of the address */
+int lvinreg = 1;                /* LV_MEM: address already in the accumulator */
+struct operand lvbase;          /* LV_MEM: base of the element, for aliasing */
+
+/* Struct the last primary or postfix produced: its address (EK_OBJ)
+ * or a pointer to it (EK_PTR, once loaded); or a 2-D array whose rows
+ * [ selects (EK_ROWS) */
+enum { EK_NONE, EK_OBJ, EK_PTR, EK_ROWS };
+int ekind = EK_NONE;
+int etag = -1;
+struct symbol *erows = NULL;    /* EK_ROWS: the array */
+
+/* Local value numbering within a basic block */
+struct vnentry vn[MAXVN];
+int vnage = 0;
+int vnowner[8];
+char *vnregs_x64[] = {"%r8", "%r9", "%r10", "%r11"};
+char *vnregs_arm64[] = {"x9", "x10", "x11", "x12", "x13", "x14", "x15"};
+
+/* Argument registers */
+char *argregs_x64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+char *argregs_arm64[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
+
+/* Memory-order names accepted by the __atomic intrinsics */
+char *atomic_orders[] = {"__ATOMIC_RELAXED", "__ATOMIC_CONSUME",
+                         "__ATOMIC_ACQUIRE", "__ATOMIC_RELEASE",
+                         "__ATOMIC_ACQ_REL", "__ATOMIC_SEQ_CST"};
+
+/* Registers handed out to "r" asm operands */
+char *asmregs_x64[] = {"%rax", "%rcx", "%rdx", "%rsi", "%rdi",
+                       "%r8", "%r9", "%r10", "%r11"};
+char *asmregs_arm64[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
+                         "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15"};
+struct operand lastop;          /* operand loaded by the last simple load */
+int lastop_at = -1;             /* its first and one-past-last code index */
+int lastop_end = -1;
+
+/* Operations that must not be executed speculatively: stores, calls,
+ * loads through computed addresses and divisions */
+int unsafe_ops = 0;
+
+/* Last assignment var = rhs, and the code range of its rhs */
+struct symbol *asg_var = NULL;
+int asg_start, asg_rhs_end;
+
+/* Set by statement() when the statement was exactly var = rhs; with an
+ * rhs that is safe to evaluate unconditionally */
+struct symbol *spec_var = NULL;
+int spec_start, spec_rhs_end, spec_end;
+
+/* Vector expressions: lane type being evaluated (0 until known), and
+ * the variable loaded by the last vector load, as for lastop */
+int vtype = 0;
+struct symbol *vlastsym = NULL;
+int vlast_at = -1, vlast_end = -1;
 
 /* Forward declarations */
 void program(void);
-void global_declaration(int type);
+void global_declaration(char *name, int type, int ptr, int tag, int isconst);
 void function(int type);
 void parameter_list(void);
 void statement(void);
+void local_declarations(void);
+void asm_statement(void);
+void release_stack(int base);
+int inline_call(char *fname);
+void vec_expr(int level);
+void vec_store_var(struct symbol *sym);
+int isvec(int type);
+int sizeof_operand(void);
+int offsetof_operand(void);
 void expression(void);
 void assignment(void);
 void logical_or(void);
@@ -121,6 +442,7 @@ void multiplicative(void);
 void unary(void);
 void postfix(void);
 void primary(void);
+void call(char *fname);
 int gettoken(void);
 void error(char *msg);
 void emit(char *fmt, ...);
@@ -130,18 +452,33 @@ void emit_branch_false(int n);
 void push(void);
 void pop(char *reg);
 struct symbol *lookup(char *name);
-struct symbol *add_symbol(char *name, int type, int size);
+struct symbol *add_symbol(char *name, int type, int size, int tag, int align);
 struct function *lookup_func(char *name);
 struct function *add_function(char *name);
 void emit_load_param(int offset);
 void emit_store_local(int offset);
 void emit_load_local(int offset);
+void rvalue(void);
+void vn_clear(void);
+void vn_store_var(struct symbol *sym);
+int add_string(char *s, int len);
+void load_arg(struct operand *op, int spill, char *reg);
+void emit_string_pool(void);
 
 /* Error handling with cleanup */
 void error(char *msg) {
+    char *near = lptr;
+    int n;
+    
+    /* While lexing, the text at the lexer; after, the current token.
+     * Either way no further than the end of its line. */
+    if (!*near && ts->src && tokpos > 0 && tokpos <= ts->n) {
+        near = ts->src + ts->off[tokpos - 1];
+    }
+    n = strcspn(near, "\n");
     fprintf(stderr, "%s:%d: Error: %s\n", filename, lineno, msg);
-    if (*lptr) {
-        fprintf(stderr, "  Near: %.20s...\n", lptr);
+    if (n) {
+        fprintf(stderr, "  Near: %.*s...\n", n < 20 ? n : 20, near);
     }
     
     /* Clean up and exit */
@@ -154,17 +491,218 @@ void warning(char *msg) {
     fprintf(stderr, "%s:%d: Warning: %s\n", filename, lineno, msg);
 }
 
-#include <stdarg.h>
+/* n bytes from arena a, 16-byte aligned and not cleared */
+void *arena_alloc(struct arena *a, size_t n) {
+    struct arenablock *b;
+    size_t size;
+    
+    n = (n + 15) & ~(size_t)15;
+    if (!a->block || a->used + n > a->block->size) {
+        size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(struct arenablock) + size);
+        if (!b) error("Out of memory");
+        b->prev = a->block;
+        b->size = size;
+        a->block = b;
+        a->used = 0;
+    }
+    a->used += n;
+    return (char *)(a->block + 1) + a->used - n;
+}
+
+/* Free everything in arena a; its last block is kept for reuse */
+void arena_reset(struct arena *a) {
+    struct arenablock *b;
+    
+    if (!a->block) return;
+    while ((b = a->block->prev)) {
+        a->block->prev = b->prev;
+        free(b);
+    }
+    a->used = 0;
+}
+
+char *arena_strdup(struct arena *a, char *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(a, n), s, n);
+}
+
+/* Make room for entry n of a table with room for *cap entries of elem
+ * bytes; returns the table, moved to a larger copy if it had to grow */
+void *grow(struct arena *a, void *table, int n, int *cap, size_t elem) {
+    void *t;
+    int old = *cap;
+    
+    if (n < *cap) return table;
+    while (n >= *cap) *cap = *cap ? *cap * 2 : 16;
+    t = arena_alloc(a, (size_t)*cap * elem);
+    if (old) memcpy(t, table, (size_t)old * elem);
+    return t;
+}
+
+#define GROW(a, table, n, cap) ((table) = grow(a, table, n, &(cap), sizeof(*(table))))
+
+/* -stats: wall clock in seconds */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Charge the time so far to the current phase and switch to ph; returns
+ * the phase to switch back to */
+int phase_enter(int ph) {
+    int prev = phase;
+    if (stats) {
+        double t = now();
+        stat_time[phase] += t - phase_t0;
+        phase_t0 = t;
+    }
+    phase = ph;
+    return prev;
+}
+
+/* A formatted string in arena a, formatted straight into the free end
+ * of the current block; only one that does not fit is formatted twice */
+char *arena_vprintf(struct arena *a, char *fmt, va_list args) {
+    va_list again;
+    size_t room = a->block ? a->block->size - a->used : 0;
+    char *s = room ? (char *)(a->block + 1) + a->used : NULL;
+    int n;
+    
+    va_copy(again, args);
+    n = vsnprintf(s, room, fmt, again);
+    va_end(again);
+    if ((size_t)n < room) return arena_alloc(a, n + 1);
+    s = arena_alloc(a, n + 1);
+    vsnprintf(s, n + 1, fmt, args);
+    return s;
+}
+
+char *arena_printf(struct arena *a, char *fmt, ...) {
+    va_list args;
+    char *s;
+    va_start(args, fmt);
+    s = arena_vprintf(a, fmt, args);
+    va_end(args);
+    return s;
+}
+
 void emit(char *fmt, ...) {
     va_list args;
+    int ph = phase_enter(buffering ? PH_EMIT : PH_OUTPUT);
     va_start(args, fmt);
-    vprintf(fmt, args);
-    printf("\n");
+    if (buffering) {
+        if (ncode >= maxcode) {
+            int cap = maxcode;
+            GROW(&func_arena, code, ncode, cap);
+            GROW(&func_arena, codeline, ncode, maxcode);
+        }
+        codeline[ncode] = keep_line ? keep_line : lineno;
+        code[ncode++] = arena_vprintf(&func_arena, fmt, args);
+    } else {
+        out_bytes += vprintf(fmt, args);
+        out_bytes += printf("\n");
+    }
     va_end(args);
+    phase_enter(ph);
+}
+
+/* Append a copy of a row, keeping its source line */
+void emit_row(char *s, int line) {
+    keep_line = line;
+    emit("%s", s);
+    keep_line = 0;
+}
+
+/* Start collecting a function body */
+void begin_code(void) {
+    buffering = 1;
+    ncode = 0;
+    vn_clear();
+}
+
+/* Rows that are instructions, not labels or directives */
+int is_insn(char *s) {
+    return s[0] == ' ' && s[2] != '.';
+}
+
+/* Write one finished row: to the output, or in whole-program mode to the
+ * held-back text */
+void put_row(char *s) {
+    int n;
+    if (!whole) {
+        out_bytes += printf("%s\n", s);
+        return;
+    }
+    n = strlen(s);
+    GROW(&perm_arena, wholetext, wholelen + n + 1, maxwhole);
+    memcpy(wholetext + wholelen, s, n);
+    wholelen += n;
+    wholetext[wholelen++] = '\n';
+}
+
+/* -annotate: source line n as a comment, with the instructions the
+ * function spends on it; then, for -g as well, its .loc */
+void annotate_line(int n) {
+    char *text = n > 0 && n <= nsrclines ? srctext + srcoff[n - 1] : "";
+    
+    while (isspace(*text)) text++;
+    if (annotate) {
+        put_row(arena_printf(&func_arena, "%s %s:%d [%d] %s", target == TARGET_X64 ? "#" : "//",
+                             filename, n, lineinsns[n], text));
+    }
+    put_row(arena_printf(&func_arena, ".loc %d %d", unitno, n));
+}
+
+/* -annotate: rank the lines of the function among the costliest so far,
+ * and clear their counts for the next function */
+void annotate_done(void) {
+    int i, j, n;
+    for (i = 0; i < ncode; i++) {
+        n = codeline[i];
+        if (!lineinsns[n]) continue;
+        for (j = nhotlines; j > 0 && hotlines[j - 1].insns < lineinsns[n]; j--) {
+            if (j < NHOTLINES) hotlines[j] = hotlines[j - 1];
+        }
+        if (j < NHOTLINES) {
+            hotlines[j].file = filename;
+            hotlines[j].func = curfunc;
+            hotlines[j].line = n;
+            hotlines[j].insns = lineinsns[n];
+            if (nhotlines < NHOTLINES) nhotlines++;
+        }
+        lineinsns[n] = 0;
+    }
+}
+
+/* Write out the collected body; erased instructions are empty strings */
+void flush_code(void) {
+    int i, last = 0, ph = phase_enter(PH_OUTPUT);
+    vn_clear();
+    if (ncode > peak_code) peak_code = ncode;
+    for (i = 0; annotate && i < ncode; i++) {
+        if (codeline[i] > nsrclines + 1) codeline[i] = 0;
+        if (code[i][0] && is_insn(code[i])) lineinsns[codeline[i]]++;
+    }
+    for (i = 0; i < ncode; i++) {
+        if (!code[i][0]) continue;
+        if (is_insn(code[i])) stat_insns++;
+        if ((annotate || debug_lines) && codeline[i] != last && code[i][0] != '.') {
+            annotate_line(codeline[i]);
+            last = codeline[i];
+        }
+        put_row(code[i]);
+    }
+    if (annotate) annotate_done();
+    ncode = 0;
+    buffering = 0;
+    phase_enter(ph);
 }
 
 void emit_label(int n) {
-    printf("L%d:\n", n);
+    emit("L%d:", n);
+    vn_clear();     /* a label starts a new basic block */
 }
 
 void emit_jump(int n) {
@@ -230,6 +768,436 @@ void emit_load_local(int offset) {
     }
 }
 
+/* Scalar variables: locals live in the frame, globals by name */
+void emit_load_var(struct symbol *sym) {
+    lastop_at = ncode;
+    if (sym->isparam || sym->offset < 0) {
+        emit_load_local(sym->offset);
+    } else if (target == TARGET_X64) {
+        emit("  movq %s(%%rip), %%rax", sym->name);
+    } else {
+        emit("  adrp x0, %s", sym->name);
+        emit("  ldr x0, [x0, :lo12:%s]", sym->name);
+    }
+    lastop_end = ncode;
+    lastop.kind = OP_VAR;
+    lastop.sym = sym;
+}
+
+void emit_store_var(struct symbol *sym) {
+    sym->written = 1;
+    if (sym->isparam || sym->offset < 0) {
+        emit_store_local(sym->offset);
+    } else if (target == TARGET_X64) {
+        emit("  movq %%rax, %s(%%rip)", sym->name);
+    } else {
+        emit("  adrp x1, %s", sym->name);
+        emit("  str x0, [x1, :lo12:%s]", sym->name);
+    }
+    unsafe_ops++;
+    vn_store_var(sym);
+}
+
+/* Store a register other than the accumulator to a scalar variable */
+void emit_store_reg(struct symbol *sym, char *reg) {
+    sym->written = 1;
+    if (sym->isparam || sym->offset < 0) {
+        if (target == TARGET_X64) {
+            emit("  movq %s, %d(%%rbp)", reg, sym->offset);
+        } else {
+            emit("  str %s, [x29, #%d]", reg, sym->offset);
+        }
+    } else if (target == TARGET_X64) {
+        emit("  movq %s, %s(%%rip)", reg, sym->name);
+    } else {
+        char *tmp = strcmp(reg, "x16") ? "x16" : "x17";
+        emit("  adrp %s, %s", tmp, sym->name);
+        emit("  str %s, [%s, :lo12:%s]", reg, tmp, sym->name);
+    }
+    unsafe_ops++;
+    vn_store_var(sym);
+}
+
+/* Locals aligned beyond the 16 bytes the frame guarantees live in a
+ * padded area; the slot at their offset holds the aligned address */
+int aligned_slot(struct symbol *sym) {
+    return sym->align > 16 && !sym->isparam && sym->offset < 0;
+}
+
+void emit_addr_var(struct symbol *sym) {
+    lastop_at = ncode;
+    if (aligned_slot(sym)) {
+        emit_load_local(sym->offset);
+    } else if (sym->isparam || sym->offset < 0) {
+        if (target == TARGET_X64) {
+            emit("  leaq %d(%%rbp), %%rax", sym->offset);
+        } else {
+            emit("  add x0, x29, #%d", sym->offset);
+        }
+    } else {
+        if (target == TARGET_X64) {
+            emit("  movq $%s, %%rax", sym->name);
+        } else {
+            emit("  adrp x0, %s", sym->name);
+            emit("  add x0, x0, :lo12:%s", sym->name);
+        }
+    }
+    lastop_end = ncode;
+    lastop.kind = OP_ADDR;
+    lastop.sym = sym;
+}
+
+void emit_load_const(int val) {
+    lastop_at = ncode;
+    if (target == TARGET_X64) {
+        emit("  movq $%d, %%rax", val);
+    } else {
+        emit("  mov x0, #%d", val);
+    }
+    lastop_end = ncode;
+    lastop.kind = OP_CONST;
+    lastop.val = val;
+}
+
+/* Operand loaded by the code emitted since mark, if it was one simple load */
+struct operand simple_operand(int mark) {
+    struct operand op;
+    op.kind = OP_NONE;
+    if (mark >= 0 && lastop_at == mark && lastop_end == ncode) op = lastop;
+    lastop_at = -1;
+    lastop_end = -1;
+    return op;
+}
+
+/*
+ * Local value numbering. Array elements whose base and index are simple
+ * operands are keyed on (base, index); their address and loaded value are
+ * kept in scratch registers the code generator does not otherwise touch
+ * between calls. The copy into a register is emitted speculatively and
+ * erased again if nothing reused it. Entries die at labels and calls, and
+ * when a store may have changed an operand or the element.
+ */
+char *vnreg(int r) {
+    return target == TARGET_X64 ? vnregs_x64[r] : vnregs_arm64[r];
+}
+
+int nvnregs(void) {
+    return target == TARGET_X64 ? 4 : 7;
+}
+
+int nregargs(void) {
+    return target == TARGET_X64 ? 6 : 8;
+}
+
+char *argreg(int i) {
+    return target == TARGET_X64 ? argregs_x64[i] : argregs_arm64[i];
+}
+
+/* Load a simple operand straight into reg */
+void emit_operand_to(struct operand *op, char *reg) {
+    struct symbol *sym = op->sym;
+    int local = op->kind == OP_VAR || op->kind == OP_ADDR ?
+                (sym->isparam || sym->offset < 0) : 0;
+    
+    if (target == TARGET_X64) {
+        switch (op->kind) {
+            case OP_CONST: emit("  movq $%d, %s", op->val, reg); break;
+            case OP_STR: emit("  movq $S%d, %s", op->val, reg); break;
+            case OP_VAR:
+                if (local) emit("  movq %d(%%rbp), %s", sym->offset, reg);
+                else emit("  movq %s(%%rip), %s", sym->name, reg);
+                break;
+            case OP_ADDR:
+                if (local && aligned_slot(sym)) emit("  movq %d(%%rbp), %s", sym->offset, reg);
+                else if (local) emit("  leaq %d(%%rbp), %s", sym->offset, reg);
+                else emit("  movq $%s, %s", sym->name, reg);
+                break;
+        }
+    } else {
+        switch (op->kind) {
+            case OP_CONST: emit("  mov %s, #%d", reg, op->val); break;
+            case OP_STR:
+                emit("  adrp %s, S%d", reg, op->val);
+                emit("  add %s, %s, :lo12:S%d", reg, reg, op->val);
+                break;
+            case OP_VAR:
+                if (local) {
+                    emit("  ldr %s, [x29, #%d]", reg, sym->offset);
+                } else {
+                    emit("  adrp %s, %s", reg, sym->name);
+                    emit("  ldr %s, [%s, :lo12:%s]", reg, reg, sym->name);
+                }
+                break;
+            case OP_ADDR:
+                if (local && aligned_slot(sym)) {
+                    emit("  ldr %s, [x29, #%d]", reg, sym->offset);
+                } else if (local) {
+                    emit("  add %s, x29, #%d", reg, sym->offset);
+                } else {
+                    emit("  adrp %s, %s", reg, sym->name);
+                    emit("  add %s, %s, :lo12:%s", reg, reg, sym->name);
+                }
+                break;
+        }
+    }
+}
+
+int same_operand(struct operand *a, struct operand *b) {
+    if (a->kind != b->kind) return 0;
+    if (a->kind == OP_CONST || a->kind == OP_STR) return a->val == b->val;
+    return a->sym == b->sym;
+}
+
+/* Globals and address-taken locals can be written through pointers */
+int may_alias(struct operand *op) {
+    if (op->kind != OP_VAR) return 0;
+    if (op->sym->addrtaken) return 1;
+    return !(op->sym->isparam || op->sym->offset < 0);
+}
+
+void vn_drop_value(int e) {
+    if (vn[e].vreg < 0) return;
+    if (vn[e].vsave >= 0) code[vn[e].vsave][0] = '\0';
+    vnowner[vn[e].vreg] = -1;
+    vn[e].vreg = -1;
+}
+
+void vn_drop(int e) {
+    if (!vn[e].valid) return;
+    vn_drop_value(e);
+    if (vn[e].asave >= 0) code[vn[e].asave][0] = '\0';
+    vnowner[vn[e].areg] = -1;
+    vn[e].valid = 0;
+}
+
+void vn_clear(void) {
+    int i;
+    for (i = 0; i < MAXVN; i++) vn_drop(i);
+    for (i = 0; i < 8; i++) vnowner[i] = -1;
+}
+
+/* Oldest live entry other than keep */
+int vn_oldest(int keep) {
+    int i, best = -1;
+    for (i = 0; i < MAXVN; i++) {
+        if (i == keep || !vn[i].valid) continue;
+        if (best < 0 || vn[i].age < vn[best].age) best = i;
+    }
+    return best;
+}
+
+/* Free scratch register for entry keep, evicting older entries */
+int vn_alloc(int keep) {
+    int r;
+    while (1) {
+        for (r = 0; r < nvnregs(); r++) {
+            if (vnowner[r] < 0) {
+                vnowner[r] = keep;
+                return r;
+            }
+        }
+        vn_drop(vn_oldest(keep));
+    }
+}
+
+int vn_find(struct operand *base, struct operand *index) {
+    int i;
+    for (i = 0; i < MAXVN; i++) {
+        if (vn[i].valid && same_operand(&vn[i].base, base) &&
+            same_operand(&vn[i].index, index))
+            return i;
+    }
+    return -1;
+}
+
+/* Record the element address now in the accumulator */
+int vn_add(struct operand *base, struct operand *index) {
+    int e;
+    for (e = 0; e < MAXVN && vn[e].valid; e++)
+        ;
+    if (e == MAXVN) {
+        e = vn_oldest(-1);
+        vn_drop(e);
+    }
+    vn[e].valid = 1;
+    vn[e].age = vnage++;
+    vn[e].base = *base;
+    vn[e].index = *index;
+    vn[e].vreg = -1;
+    vn[e].vsave = -1;
+    vn[e].areg = vn_alloc(e);
+    vn[e].asave = ncode;
+    if (target == TARGET_X64) {
+        emit("  movq %%rax, %s", vnreg(vn[e].areg));
+    } else {
+        emit("  mov %s, x0", vnreg(vn[e].areg));
+    }
+    return e;
+}
+
+/* A variable was assigned: elements indexed by it move, and unless it is
+ * a private local it may also be the storage behind a cached element */
+void vn_store_var(struct symbol *sym) {
+    int i;
+    struct operand op;
+    op.kind = OP_VAR;
+    op.sym = sym;
+    for (i = 0; i < MAXVN; i++) {
+        if (!vn[i].valid) continue;
+        if (same_operand(&vn[i].base, &op) || same_operand(&vn[i].index, &op)) {
+            vn_drop(i);
+        } else if (may_alias(&op)) {
+            vn_drop_value(i);
+        }
+    }
+}
+
+/* A store through a computed address. A store into a named array only
+ * changes elements of that array or of pointer-based elements. */
+void vn_store_mem(struct operand *base) {
+    int i;
+    for (i = 0; i < MAXVN; i++) {
+        if (!vn[i].valid) continue;
+        if (base->kind == OP_ADDR) {
+            if (vn[i].base.kind != OP_ADDR || vn[i].base.sym == base->sym)
+                vn_drop_value(i);
+        } else if (may_alias(&vn[i].base) || may_alias(&vn[i].index)) {
+            vn_drop(i);
+        } else {
+            vn_drop_value(i);
+        }
+    }
+}
+
+/* Load dst from, or store the accumulator to, disp(areg); char fields
+ * are a single byte */
+void emit_mem_load(char *dst, char *areg, int disp, int width) {
+    if (target == TARGET_X64) {
+        char *op = width == 1 ? "movsbq" : "movq";
+        if (disp) emit("  %s %d(%s), %s", op, disp, areg, dst);
+        else emit("  %s (%s), %s", op, areg, dst);
+    } else {
+        char *op = width == 1 ? "ldrsb" : "ldr";
+        if (disp) emit("  %s %s, [%s, #%d]", op, dst, areg, disp);
+        else emit("  %s %s, [%s]", op, dst, areg);
+    }
+}
+
+void emit_mem_store(char *areg, int disp, int width) {
+    if (target == TARGET_X64) {
+        char *src = width == 1 ? "movb %al" : "movq %rax";
+        if (disp) emit("  %s, %d(%s)", src, disp, areg);
+        else emit("  %s, (%s)", src, areg);
+    } else {
+        char *src = width == 1 ? "strb w0" : "str x0";
+        if (disp) emit("  %s, [%s, #%d]", src, areg, disp);
+        else emit("  %s, [%s]", src, areg);
+    }
+}
+
+/* Field at disp of a named struct: one frame- or symbol-relative access */
+void emit_field(struct symbol *sym, int disp, int width, int store) {
+    int off = sym->offset + disp;
+    if (sym->isparam || sym->offset < 0) {
+        if (store) emit_mem_store(target == TARGET_X64 ? "%rbp" : "x29", off, width);
+        else emit_mem_load(target == TARGET_X64 ? "%rax" : "x0",
+                           target == TARGET_X64 ? "%rbp" : "x29", off, width);
+    } else {
+        char *ref = sym->name;
+        if (disp) ref = arena_printf(&func_arena, "%s+%d", sym->name, disp);
+        if (target == TARGET_X64) {
+            if (store) {
+                emit("  %s, %s(%%rip)", width == 1 ? "movb %al" : "movq %rax", ref);
+            } else {
+                emit("  %s %s(%%rip), %%rax", width == 1 ? "movsbq" : "movq", ref);
+            }
+        } else if (store) {
+            emit("  adrp x1, %s", ref);
+            emit("  %s, [x1, :lo12:%s]", width == 1 ? "strb w0" : "str x0", ref);
+        } else {
+            emit("  adrp x0, %s", ref);
+            emit("  %s x0, [x0, :lo12:%s]", width == 1 ? "ldrsb" : "ldr", ref);
+        }
+    }
+    if (store) {
+        struct operand op;
+        op.kind = OP_ADDR;
+        op.sym = sym;
+        unsafe_ops++;
+        vn_store_mem(&op);
+    }
+}
+
+void emit_add_const(int val) {
+    if (!val) return;
+    if (target == TARGET_X64) {
+        emit("  addq $%d, %%rax", val);
+    } else {
+        emit("  add x0, x0, #%d", val);
+    }
+}
+
+/* Make sure a pending LV_MEM address is in the accumulator */
+void lvaddr(void) {
+    if (lvinreg) return;
+    vn[lvvn].asave = -1;
+    if (target == TARGET_X64) {
+        emit("  movq %s, %%rax", vnreg(vn[lvvn].areg));
+    } else {
+        emit("  mov x0, %s", vnreg(vn[lvvn].areg));
+    }
+    lvinreg = 1;
+}
+
+/* Stores to a const object through its name are rejected here instead
+ * of faulting at run time in .rodata */
+void check_store(int kind, struct symbol *sym, struct operand *base) {
+    if ((kind == LV_VAR || kind == LV_FIELD) && sym && sym->isconst) {
+        error("Assignment to const");
+    }
+    if (kind == LV_MEM && base->kind == OP_ADDR && base->sym->isconst) {
+        error("Assignment to const");
+    }
+}
+
+/* Turn a pending lvalue into its value */
+void rvalue(void) {
+    if (lval == LV_VAR) {
+        if (isvec(lvsym->type)) error("Vector in scalar expression");
+        emit_load_var(lvsym);
+    } else if (lval == LV_MEM) {
+        int e = lvvn;
+        if (e >= 0 && vn[e].vreg >= 0) {
+            vn[e].vsave = -1;
+            if (target == TARGET_X64) {
+                emit("  movq %s, %%rax", vnreg(vn[e].vreg));
+            } else {
+                emit("  mov x0, %s", vnreg(vn[e].vreg));
+            }
+        } else {
+            char *areg = target == TARGET_X64 ? "%rax" : "x0";
+            if (!lvinreg) {
+                areg = vnreg(vn[e].areg);
+                vn[e].asave = -1;
+            }
+            emit_mem_load(target == TARGET_X64 ? "%rax" : "x0", areg, lvdisp, lvwidth);
+            unsafe_ops++;
+            if (e >= 0) {
+                vn[e].vreg = vn_alloc(e);
+                vn[e].vsave = ncode;
+                if (target == TARGET_X64) {
+                    emit("  movq %%rax, %s", vnreg(vn[e].vreg));
+                } else {
+                    emit("  mov %s, x0", vnreg(vn[e].vreg));
+                }
+            }
+        }
+    } else if (lval == LV_FIELD) {
+        emit_field(lvsym, lvdisp, lvwidth, 0);
+    }
+    lval = LV_NONE;
+}
+
 /* Emit assembly based on target */
 void emit_prolog(void) {
     if (target == TARGET_X64) {
@@ -251,7 +1219,8 @@ void skip_white(void) {
     }
 }
 
-void skip_comment(void) {
+/* Skip one comment; returns 0 if there was none */
+int skip_comment(void) {
     if (*lptr == '/' && *(lptr+1) == '/') {
         while (*lptr && *lptr != '\n') lptr++;
         if (*lptr == '\n') {
@@ -266,19 +1235,16 @@ void skip_comment(void) {
         }
         if (*lptr) lptr += 2;
         else error("Unterminated comment");
+    } else {
+        return 0;
     }
+    return 1;
 }
 
-int gettoken(void) {
-    skip_white();
-    skip_comment();
-    skip_white();
-    
-    if (!*lptr) {
-        if (!fgets(line, LINESIZE, input)) return T_EOF;
-        lptr = line;
-        return gettoken();
-    }
+/* Scan the token at lptr. The spelling of identifiers, keywords and
+ * strings is written to tokstr, which has room for it. */
+int scan_token(void) {
+    if (!*lptr) return T_EOF;
     
     /* Character literals */
     if (*lptr == '\'') {
@@ -306,7 +1272,7 @@ int gettoken(void) {
     }
     
     /* Single character tokens */
-    if (strchr("+-*/%&|^~!<>()[]{}.,;=", *lptr)) {
+    if (strchr("+-*/%&|^~!<>()[]{}.,;=:", *lptr)) {
         int c = *lptr++;
         
         /* Two character tokens */
@@ -320,6 +1286,7 @@ int gettoken(void) {
         if (c == '|' && *lptr == '|') { lptr++; return T_OR; }
         if (c == '+' && *lptr == '+') { lptr++; return T_INC; }
         if (c == '-' && *lptr == '-') { lptr++; return T_DEC; }
+        if (c == '-' && *lptr == '>') { lptr++; return T_ARROW; }
         if (c == '+' && *lptr == '=') { lptr++; return T_PLUSEQ; }
         if (c == '-' && *lptr == '=') { lptr++; return T_MINUSEQ; }
         if (c == '*' && *lptr == '=') { lptr++; return T_STAREQ; }
@@ -350,14 +1317,8 @@ int gettoken(void) {
     /* Identifiers and keywords */
     if (isalpha(*lptr) || *lptr == '_') {
         char *p = tokstr;
-        int len = 0;
-        while ((isalnum(*lptr) || *lptr == '_') && len < NAMESIZE - 1) {
-            *p++ = *lptr++;
-            len++;
-        }
-        /* Skip remaining characters if identifier is too long */
         while (isalnum(*lptr) || *lptr == '_') {
-            lptr++;
+            *p++ = *lptr++;
         }
         *p = '\0';
         
@@ -370,6 +1331,12 @@ int gettoken(void) {
         if (!strcmp(tokstr, "return")) return T_RETURN;
         if (!strcmp(tokstr, "break")) return T_BREAK;
         if (!strcmp(tokstr, "continue")) return T_CONTINUE;
+        if (!strcmp(tokstr, "asm") || !strcmp(tokstr, "__asm__")) return T_ASM;
+        if (!strcmp(tokstr, "vchar16")) return T_VCHAR16;
+        if (!strcmp(tokstr, "vint2")) return T_VINT2;
+        if (!strcmp(tokstr, "struct")) return T_STRUCT;
+        if (!strcmp(tokstr, "sizeof")) return T_SIZEOF;
+        if (!strcmp(tokstr, "const")) return T_CONST;
         
         return T_IDENT;
     }
@@ -379,10 +1346,10 @@ int gettoken(void) {
         lptr++;
         char *p = tokstr;
         int len = 0;
-        while (*lptr && *lptr != '"' && len < NAMESIZE - 1) {
+        while (*lptr && *lptr != '"' && *lptr != '\n') {
             if (*lptr == '\\') {
                 lptr++;
-                if (!*lptr) {
+                if (!*lptr || *lptr == '\n') {
                     error("Unterminated string literal");
                     return T_EOF;
                 }
@@ -401,12 +1368,12 @@ int gettoken(void) {
                 lptr++;
                 len++;
             } else {
-                if (*lptr == '\n') lineno++;
                 *p++ = *lptr++;
                 len++;
             }
         }
         *p = '\0';
+        toklen = len;
         
         if (*lptr == '"') {
             lptr++;
@@ -414,10 +1381,6 @@ int gettoken(void) {
             error("Unterminated string literal");
         }
         
-        if (len >= NAMESIZE - 1) {
-            warning("String literal truncated");
-        }
-        
         return T_STRING;
     }
     
@@ -425,71 +1388,244 @@ int gettoken(void) {
     return T_EOF;
 }
 
+/* Lex all of input into unit_tokens and start parsing it. Spellings
+ * and their NULs take at most twice the source. */
+void lex_unit(void) {
+    struct tokstream *u = &unit_tokens;
+    int ph = phase_enter(PH_LEX), size = 0, cap = 0, n, t, c;
+    char *src = NULL;
+    
+    do {
+        GROW(&unit_arena, src, size + 4096, cap);
+        n = fread(src + size, 1, cap - size - 1, input);
+        size += n;
+    } while (n > 0);
+    src[size] = '\0';
+    memset(u, 0, sizeof(*u));
+    u->src = src;
+    u->pool = arena_alloc(&unit_arena, 2 * (size_t)size + 2);
+    lptr = src;
+    do {
+        do skip_white(); while (skip_comment());
+        if (u->n >= u->cap) {
+            c = u->cap;
+            GROW(&unit_arena, u->kind, u->n, c);
+            c = u->cap;
+            GROW(&unit_arena, u->value, u->n, c);
+            c = u->cap;
+            GROW(&unit_arena, u->line, u->n, c);
+            c = u->cap;
+            GROW(&unit_arena, u->off, u->n, c);
+            GROW(&unit_arena, u->text, u->n, u->cap);
+        }
+        u->off[u->n] = lptr - src;
+        u->line[u->n] = lineno;
+        tokstr = u->pool + u->poolsize;
+        t = scan_token();
+        u->kind[u->n] = t;
+        u->value[u->n] = t == T_STRING ? toklen : tokval;
+        u->text[u->n] = -1;
+        if (t == T_STRING) {
+            u->text[u->n] = u->poolsize;
+            u->poolsize += toklen + 1;
+        } else if (isalpha(src[u->off[u->n]]) || src[u->off[u->n]] == '_') {
+            u->text[u->n] = u->poolsize;
+            u->poolsize += strlen(tokstr) + 1;
+        }
+        u->n++;
+        stat_tokens++;
+    } while (t != T_EOF);
+    lptr = "";
+    ts = u;
+    tokpos = 0;
+    phase_enter(ph);
+}
+
+/* The next token of the stream; T_EOF past its end */
+int gettoken(void) {
+    int t;
+    
+    if (tokpos >= ts->n) return T_EOF;
+    t = ts->kind[tokpos];
+    if (ts->line) lineno = ts->line[tokpos];
+    if (t == T_STRING) {
+        toklen = ts->value[tokpos];
+    } else if (t == T_NUMBER || t == T_CHARLIT) {
+        tokval = ts->value[tokpos];
+    }
+    if (ts->text[tokpos] >= 0) tokstr = ts->pool + ts->text[tokpos];
+    tokpos++;
+    return t;
+}
+
+/* Index of the current token, to come back to with token_seek */
+int token_mark(void) {
+    return tokpos - 1;
+}
+
+/* Make the token at index pos the current one again */
+void token_seek(int pos) {
+    tokpos = pos;
+    token = gettoken();
+}
+
 /* Symbol table */
-struct symbol *lookup(char *name) {
+unsigned name_hash(char *s) {
+    unsigned h = 0;
+    while (*s) h = h * 31 + (unsigned char)*s++;
+    return h % NAMEHASH;
+}
+
+/* Globals and functions are found through hash chains; a global
+ * declared again is not chained, so the first declaration is found */
+struct symbol *find_global(char *name) {
+    int i;
+    for (i = globhash[name_hash(name)]; i >= 0; i = globals[i]->next) {
+        stat_probes++;
+        if (!strcmp(globals[i]->name, name)) return globals[i];
+    }
+    return NULL;
+}
+
+struct symbol *find_symbol(char *name) {
     int i;
-    /* Check locals first */
-    for (i = 0; i < nlocals; i++) {
-        if (!strcmp(locals[i].name, name)) return &locals[i];
+    /* Check locals first, innermost block first */
+    for (i = nlocals - 1; i >= lookup_floor; i--) {
+        stat_probes++;
+        if (!strcmp(locals[i]->name, name)) return locals[i];
     }
     /* Then check globals */
-    for (i = 0; i < nglobals; i++) {
-        if (!strcmp(globals[i].name, name)) return &globals[i];
+    return find_global(name);
+}
+
+/* Count a lookup that took the probes since probes0, for -stats */
+void count_lookup(long probes0) {
+    stat_lookups++;
+    if (stat_probes - probes0 > stat_maxprobe) stat_maxprobe = stat_probes - probes0;
+}
+
+struct symbol *lookup(char *name) {
+    int ph = phase_enter(PH_LOOKUP);
+    long probes0 = stat_probes;
+    struct symbol *sym = find_symbol(name);
+    count_lookup(probes0);
+    phase_enter(ph);
+    return sym;
+}
+
+/* The next local slot. Slots left by a closed block are reused, as
+ * their frame space is; the symbols live in func_arena. */
+struct symbol *new_local(void) {
+    if (nlocals >= maxlocals) {
+        int i = maxlocals;
+        GROW(&func_arena, locals, nlocals, maxlocals);
+        while (i < maxlocals) locals[i++] = arena_alloc(&func_arena, sizeof(struct symbol));
     }
-    return NULL;
+    if (++nlocals > peak_locals) peak_locals = nlocals;
+    return locals[nlocals - 1];
 }
 
-struct symbol *add_symbol(char *name, int type, int size) {
+struct symbol *add_symbol(char *name, int type, int size, int tag, int align) {
     struct symbol *sym;
     
-    /* Check for duplicate symbol */
-    if (nlocals > 0 && lookup(name) != NULL) {
-        error("Duplicate symbol definition");
-        return NULL;
-    }
-    
-    if (nlocals > 0 || param_offset < 16) {
-        if (nlocals >= MAXLOCALS) error("Too many local variables");
-        sym = &locals[nlocals++];
-        if (param_offset < 16) {
-            /* Function parameter */
-            sym->offset = param_offset;
+    stat_symbols++;
+    if (infunc) {
+        int i;
+        /* Check for duplicate symbol in this block; locals may shadow
+         * globals and locals of enclosing blocks */
+        for (i = scope_first; i < nlocals; i++) {
+            if (!strcmp(locals[i]->name, name)) {
+                error("Duplicate symbol definition");
+                return NULL;
+            }
+        }
+        sym = new_local();
+        if (inparams) {
+            /* Register parameters are saved below the frame pointer by the
+             * prologue; the rest were stored above the return address by
+             * the caller */
+            int n = (param_offset - 16) / 8;
+            if (n < nregargs()) {
+                sym->offset = -(n + 1) * (target == TARGET_X64 ? 8 : 16);
+            } else {
+                sym->offset = 16 + (n - nregargs()) * 8;
+            }
             sym->isparam = 1;
             param_offset += 8;
         } else {
-            /* Local variable */
+            /* Local variable; vectors get an aligned 16-byte slot */
             int alloc_size = (type < 2 ? 8 : 8) * (size > 0 ? size : 1);
-            sp -= alloc_size;
-            sym->offset = sp;
+            if (isvec(type)) {
+                alloc_size = 16;
+                if (align < 16) align = 16;
+            } else if (type == STRUCTOBJ) {
+                alloc_size = (structs[tag].size * (size > 0 ? size : 1) + 7) & ~7;
+            }
+            if (align > 16) {
+                /* Padded area, then the slot for its aligned address */
+                if (!size && type != STRUCTOBJ) {
+                    error("Only local arrays and structs can be aligned beyond 16");
+                }
+                lsp = (lsp - alloc_size - (align - 16)) & ~15;
+                lsp -= 8;
+            } else {
+                lsp -= alloc_size;
+                if (align) lsp &= -align;
+            }
+            if (lsp < lsp_min) lsp_min = lsp;
+            sym->offset = lsp;
             sym->isparam = 0;
         }
     } else {
-        if (nglobals >= MAXGLOBALS) error("Too many global variables");
-        sym = &globals[nglobals++];
+        unsigned h = name_hash(name);
+        /* -whole units share this table, so a global defined again in
+         * another unit is caught here too, not by the assembler */
+        if (find_global(name)) {
+            error("Duplicate symbol definition");
+            return NULL;
+        }
+        GROW(&perm_arena, globals, nglobals, maxglobals);
+        sym = globals[nglobals] = arena_alloc(&perm_arena, sizeof(struct symbol));
         sym->offset = lab++;
         sym->isparam = 0;
+        sym->next = globhash[h];
+        globhash[h] = nglobals;
+        nglobals++;
     }
     
-    if (strlen(name) >= NAMESIZE) {
-        warning("Symbol name truncated");
-        name[NAMESIZE-1] = '\0';
-    }
-    strcpy(sym->name, name);
+    sym->name = arena_strdup(infunc ? &func_arena : &perm_arena, name);
+    sym->addrtaken = 0;
     sym->type = type;
+    sym->tag = tag;
+    sym->align = align;
+    sym->isconst = 0;
+    sym->written = 0;
+    sym->value = 0;
+    sym->cols = 0;
     sym->isarray = (size > 0);
     sym->size = size;
     return sym;
 }
 
 /* Function table */
-struct function *lookup_func(char *name) {
+struct function *find_func(char *name) {
     int i;
-    for (i = 0; i < nfuncs; i++) {
-        if (!strcmp(functions[i].name, name)) return &functions[i];
+    for (i = funchash[name_hash(name)]; i >= 0; i = functions[i]->next) {
+        stat_probes++;
+        if (!strcmp(functions[i]->name, name)) return functions[i];
     }
     return NULL;
 }
 
+struct function *lookup_func(char *name) {
+    int ph = phase_enter(PH_LOOKUP);
+    long probes0 = stat_probes;
+    struct function *func = find_func(name);
+    count_lookup(probes0);
+    phase_enter(ph);
+    return func;
+}
+
 struct function *add_function(char *name) {
     struct function *func;
     
@@ -497,32 +1633,437 @@ struct function *add_function(char *name) {
     func = lookup_func(name);
     if (func) return func;
     
-    if (nfuncs >= MAXFUNCS) error("Too many functions");
-    func = &functions[nfuncs++];
-    
-    if (strlen(name) >= NAMESIZE) {
-        warning("Function name truncated");
-        name[NAMESIZE-1] = '\0';
-    }
-    strcpy(func->name, name);
+    GROW(&perm_arena, functions, nfuncs, maxfuncs);
+    func = functions[nfuncs++] = arena_alloc(&perm_arena, sizeof(struct function));
+    func->name = arena_strdup(&perm_arena, name);
     func->defined = 0;
     func->nparams = 0;
+    func->text_start = func->text_end = 0;
+    func->insns = 0;
+    func->frame = 0;
+    func->live = 0;
+    func->next = funchash[name_hash(name)];
+    funchash[name_hash(name)] = nfuncs - 1;
     return func;
 }
 
+/* String literal pool */
+int add_string(char *s, int len) {
+    unsigned h = 0;
+    int i;
+    
+    for (i = 0; i < len; i++) h = h * 31 + (unsigned char)s[i];
+    h %= STRHASH;
+    
+    /* Identical literals share one label */
+    for (i = strhash[h]; i >= 0; i = strlits[i].next) {
+        if (strlits[i].len == len && !memcmp(strpool + strlits[i].offset, s, len)) {
+            strlits[i].refs++;
+            return strlits[i].label;
+        }
+    }
+    
+    GROW(&perm_arena, strlits, nstrlits, maxstrlits);
+    GROW(&perm_arena, strpool, strptr + len, maxstring);
+    
+    struct strlit *lit = &strlits[nstrlits];
+    memcpy(strpool + strptr, s, len);
+    strpool[strptr + len] = '\0';
+    lit->offset = strptr;
+    lit->len = len;
+    lit->label = lab++;
+    lit->refs = 1;
+    lit->next = strhash[h];
+    strhash[h] = nstrlits++;
+    strptr += len + 1;
+    return lit->label;
+}
+
+/* Emit bytes as an assembler string, escaping anything unprintable */
+void emit_string(char *directive, char *s, int len) {
+    int i;
+    out_bytes += printf("  %s \"", directive);
+    for (i = 0; i < len; i++) {
+        int c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') out_bytes += printf("\\%c", c);
+        else if (c >= 32 && c < 127) out_bytes += printf("%c", c);
+        else out_bytes += printf("\\%03o", c);
+    }
+    out_bytes += printf("\"\n");
+}
+
+/* Emit the pool once at the end of the unit. A literal that is the tail
+ * of a longer one is not stored again; its label points into the longer
+ * literal instead. Literals whose uses were all folded away are dropped. */
+void emit_string_pool(void) {
+    int i, j;
+    
+    if (nstrlits == 0) return;
+    emit("");
+    emit(".section .rodata.str1.1,\"aMS\",@progbits,1");
+    for (i = 0; i < nstrlits; i++) {
+        struct strlit *lit = &strlits[i];
+        int host = -1;
+        if (!lit->refs) continue;
+        for (j = 0; j < nstrlits; j++) {
+            struct strlit *big = &strlits[j];
+            if (big->refs && big->len > lit->len &&
+                !memcmp(strpool + big->offset + big->len - lit->len,
+                        strpool + lit->offset, lit->len) &&
+                (host < 0 || big->len > strlits[host].len)) {
+                host = j;
+            }
+        }
+        if (host >= 0) {
+            emit(".set S%d, S%d+%d", lit->label, strlits[host].label,
+                 strlits[host].len - lit->len);
+        } else {
+            emit("S%d:", lit->label);
+            emit_string(".asciz", strpool + lit->offset, lit->len);
+        }
+    }
+}
+
+/* Symbol type of a declaration keyword followed by ptr stars */
+int decl_type(int tok, int ptr) {
+    if (tok == T_STRUCT) {
+        if (ptr > 1) return 2;
+        return ptr ? STRUCTPTR : STRUCTOBJ;
+    }
+    if (ptr) return tok == T_CHAR && ptr == 1 ? 3 : 2;
+    switch (tok) {
+        case T_CHAR: return 1;
+        case T_VCHAR16: return VCHAR16;
+        case T_VINT2: return VINT2;
+    }
+    return 0;
+}
+
+int is_type(int tok) {
+    return tok == T_INT || tok == T_CHAR || tok == T_VCHAR16 || tok == T_VINT2 ||
+           tok == T_STRUCT;
+}
+
+int isvec(int type) {
+    return type == VCHAR16 || type == VINT2;
+}
+
+int parse_stars(void) {
+    int n = 0;
+    while (token == '*') {
+        n++;
+        token = gettoken();
+    }
+    return n;
+}
+
+int lookup_struct(char *name) {
+    int i;
+    for (i = 0; i < nstructs; i++) {
+        if (!strcmp(structs[i].name, name)) return i;
+    }
+    return -1;
+}
+
+struct field *lookup_field(int tag, char *name) {
+    struct structdef *sd = &structs[tag];
+    int i;
+    for (i = sd->first; i < sd->first + sd->nfields; i++) {
+        if (!strcmp(fields[i].name, name)) return &fields[i];
+    }
+    error("No such struct field");
+    return NULL;
+}
+
+/* Bytes taken by a value of a symbol type; arrays of anything but
+ * structs use 8-byte elements, like all arrays here */
+int type_size(int type, int tag, int count) {
+    if (type == STRUCTOBJ) return structs[tag].size * (count ? count : 1);
+    if (count) return count * 8;
+    if (type == 1) return 1;
+    return isvec(type) ? 16 : 8;
+}
+
+/*
+ * struct tag, optionally followed by its definition. Fields are laid
+ * out in order at their natural alignment (char 1, everything else 8,
+ * structs their largest field) and the size is padded to the alignment
+ * so arrays of it stay aligned.
+ */
+int struct_decl(void) {
+    struct structdef *sd;
+    struct field *f;
+    int i, ft, ftag, ptr, align;
+    
+    if (token != T_IDENT) error("Expected struct tag");
+    i = lookup_struct(tokstr);
+    if (i < 0) {
+        GROW(&perm_arena, structs, nstructs, maxstructs);
+        i = nstructs++;
+        structs[i].name = arena_strdup(&perm_arena, tokstr);
+        structs[i].defined = 0;
+    }
+    token = gettoken();
+    if (token != '{') return i;
+    
+    sd = &structs[i];
+    if (sd->defined) error("Struct already defined");
+    sd->size = 0;
+    sd->align = 1;
+    sd->first = nfields;
+    sd->nfields = 0;
+    token = gettoken();
+    while (token != '}' && token != T_EOF) {
+        if (!is_type(token)) error("Expected field type");
+        ft = token;
+        token = gettoken();
+        ftag = ft == T_STRUCT ? struct_decl() : -1;
+        sd = &structs[i];       /* struct_decl may have moved the table */
+        while (1) {
+            ptr = parse_stars();
+            if (token != T_IDENT) error("Expected field name");
+            GROW(&perm_arena, fields, nfields, maxfields);
+            for (f = &fields[sd->first]; f < &fields[nfields]; f++) {
+                if (!strcmp(f->name, tokstr)) error("Duplicate struct field");
+            }
+            f = &fields[nfields++];
+            f->name = arena_strdup(&perm_arena, tokstr);
+            f->type = decl_type(ft, ptr);
+            f->tag = ftag;
+            f->count = 0;
+            if (isvec(f->type)) error("Vector fields not supported");
+            if (f->type == STRUCTOBJ && !structs[ftag].defined) {
+                error("Struct field of incomplete type");
+            }
+            token = gettoken();
+            if (token == '[') {
+                token = gettoken();
+                if (token != T_NUMBER || tokval <= 0) error("Expected array size");
+                f->count = tokval;
+                token = gettoken();
+                if (token != ']') error("Expected ]");
+                token = gettoken();
+            }
+            align = f->type == STRUCTOBJ ? structs[ftag].align : type_size(f->type, ftag, 0);
+            f->offset = (sd->size + align - 1) & -align;
+            sd->size = f->offset + type_size(f->type, ftag, f->count);
+            if (align > sd->align) sd->align = align;
+            sd->nfields++;
+            if (token != ',') break;
+            token = gettoken();
+        }
+        if (token != ';') error("Expected ;");
+        token = gettoken();
+    }
+    if (token != '}') error("Expected }");
+    token = gettoken();
+    if (!sd->nfields) error("Empty struct");
+    sd->size = (sd->size + sd->align - 1) & -sd->align;
+    sd->defined = 1;
+    return i;
+}
+
+/* Array dimension after its [, through the ] */
+int array_dim(void) {
+    int size;
+    if (token != T_NUMBER) error("Expected array size");
+    size = tokval;
+    if (size <= 0) {
+        error("Array size must be positive");
+        size = 1;
+    }
+    if (size > 65536) {
+        error("Array size too large");
+        size = 65536;
+    }
+    token = gettoken();
+    if (token != ']') error("Expected ]");
+    token = gettoken();
+    return size;
+}
+
+/* Optional second dimension [C] of a 2-D array: C, or 0 */
+int array_cols(int rows) {
+    int cols;
+    if (token != '[') return 0;
+    token = gettoken();
+    cols = array_dim();
+    if (rows * cols > 65536) error("Array size too large");
+    return cols;
+}
+
+/* Optional __aligned(N) after a declarator: N, a power of two, or 0 */
+int parse_aligned(void) {
+    int n;
+    if (token != T_IDENT || strcmp(tokstr, "__aligned")) return 0;
+    token = gettoken();
+    if (token != '(') error("Expected (");
+    token = gettoken();
+    if (token != T_NUMBER) error("Expected alignment");
+    n = tokval;
+    if (n <= 0 || (n & (n - 1))) error("Alignment must be a power of two");
+    if (n > 4096) error("Alignment too large");
+    token = gettoken();
+    if (token != ')') error("Expected )");
+    token = gettoken();
+    return n;
+}
+
+/* Start the definition of a global in .data, or .rodata if it is const,
+ * aligned if align > 1 */
+void emit_global_label(char *name, int align, int isconst) {
+    emit(isconst ? ".section .rodata" : ".data");
+    emit(".globl %s", name);
+    if (isconst && align < 8) align = 8;
+    if (align > 1) emit("  .balign %d", align);
+    emit("%s:", name);
+}
+
+/* Copy tokens from to to of the unit, for an inline body that outlives
+ * the unit; the copy ends with T_EOF and takes the line of its use */
+void copy_tokens(struct tokstream *dst, int from, int to) {
+    int i, n = to - from;
+    
+    memset(dst, 0, sizeof(*dst));
+    dst->kind = arena_alloc(&perm_arena, (n + 1) * sizeof(int));
+    dst->value = arena_alloc(&perm_arena, (n + 1) * sizeof(int));
+    dst->text = arena_alloc(&perm_arena, (n + 1) * sizeof(int));
+    dst->pool = arena_alloc(&perm_arena, ts->off[to] - ts->off[from] + n + 1);
+    for (i = 0; i < n; i++) {
+        dst->kind[i] = ts->kind[from + i];
+        dst->value[i] = ts->value[from + i];
+        dst->text[i] = -1;
+        if (ts->text[from + i] >= 0) {
+            char *t = ts->pool + ts->text[from + i];
+            int len = dst->kind[i] == T_STRING ? dst->value[i] : (int)strlen(t);
+            dst->text[i] = dst->poolsize;
+            memcpy(dst->pool + dst->poolsize, t, len + 1);
+            dst->poolsize += len + 1;
+        }
+    }
+    dst->kind[n] = T_EOF;
+    dst->text[n] = -1;
+    dst->n = dst->cap = n + 1;
+}
+
+/*
+ * -whole: before any code is generated, every unit is scanned for
+ * functions of the form  type name(params) { return expr; }  with int,
+ * char or pointer parameters and no string literal in the expression.
+ * Returns 1 if it stopped inside a function body.
+ */
+int scan_inline(void) {
+    struct inlinefn *fi;
+    int n = 0, t, ptr, end;
+    
+    GROW(&perm_arena, inlines, ninlines, maxinlines);
+    fi = &inlines[ninlines];
+    token = gettoken();
+    while (token == '*') token = gettoken();
+    if (token != T_IDENT) return 0;
+    fi->name = arena_strdup(&perm_arena, tokstr);
+    token = gettoken();
+    if (token != '(') return 0;
+    token = gettoken();
+    while (token != ')') {
+        if (token == T_CONST) token = gettoken();
+        if (token != T_INT && token != T_CHAR) return 0;
+        t = token;
+        token = gettoken();
+        ptr = parse_stars();
+        if (token != T_IDENT || n >= MAXARGS) return 0;
+        fi->ptypes[n] = decl_type(t, ptr);
+        fi->params[n++] = arena_strdup(&perm_arena, tokstr);
+        token = gettoken();
+        if (token == ',') token = gettoken();
+        else if (token != ')') return 0;
+    }
+    token = gettoken();
+    if (token != '{') return 0;
+    token = gettoken();
+    if (token != T_RETURN) return 1;
+    for (end = tokpos; ts->kind[end] != ';' && ts->kind[end] != T_EOF; end++) {
+        if (ts->kind[end] == T_STRING) return 1;
+    }
+    if (ts->kind[end] != ';') return 1;
+    copy_tokens(&fi->body, tokpos, end + 1);
+    token_seek(end + 1);
+    if (token != '}') return 1;
+    fi->nparams = n;
+    ninlines++;
+    token = gettoken();
+    return 0;
+}
+
+void scan_inlines(void) {
+    int depth = 0;
+    lex_unit();
+    token = gettoken();
+    while (token != T_EOF) {
+        if (!depth && (token == T_INT || token == T_CHAR)) {
+            depth += scan_inline();
+            continue;
+        }
+        if (token == '{') depth++;
+        else if (token == '}') depth--;
+        token = gettoken();
+    }
+}
+
+struct inlinefn *lookup_inline(char *name) {
+    int i;
+    for (i = 0; i < ninlines; i++) {
+        if (!strcmp(inlines[i].name, name)) return &inlines[i];
+    }
+    return NULL;
+}
+
+/* Every name in an inline body must be a parameter, a function, or a
+ * global already declared where the call is */
+int inline_resolvable(struct inlinefn *fi) {
+    struct tokstream *b = &fi->body;
+    char *word;
+    int i, j, found;
+    
+    for (i = 0; i < b->n; i++) {
+        if (b->kind[i] != T_IDENT) continue;
+        /* calls and field names need no symbol */
+        if (b->kind[i + 1] == '(') continue;
+        if (i > 0 && (b->kind[i - 1] == '.' || b->kind[i - 1] == T_ARROW)) continue;
+        word = b->pool + b->text[i];
+        found = 0;
+        for (j = 0; j < fi->nparams; j++) {
+            if (!strcmp(fi->params[j], word)) found = 1;
+        }
+        if (!found && !find_global(word)) return 0;
+    }
+    return 1;
+}
+
 /* Parser */
 void program(void) {
-    lptr = line;
-    line[0] = '\0';
+    lex_unit();
     token = gettoken();
     
     while (token != T_EOF) {
-        int type = T_INT;
-        if (token == T_INT || token == T_CHAR) {
+        int type = T_INT, tag = -1, ptr, isconst = 0;
+        if (token == T_CONST) {
+            isconst = 1;
+            token = gettoken();
+        }
+        if (is_type(token)) {
             type = token;
             token = gettoken();
+            if (type == T_STRUCT) tag = struct_decl();
         }
         
+        /* struct definition on its own */
+        if (type == T_STRUCT && token == ';') {
+            token = gettoken();
+            continue;
+        }
+        ptr = parse_stars();
+        
         if (token != T_IDENT) {
             error("Expected identifier");
             /* Skip to next semicolon or EOF */
@@ -533,84 +2074,147 @@ void program(void) {
             continue;
         }
         
-        char name[NAMESIZE];
-        strcpy(name, tokstr);
+        char *name = arena_strdup(&perm_arena, tokstr);
         token = gettoken();
         
         /* Function or global variable */
         if (token == '(') {
-            strcpy(curfunc, name);
+            if (isvec(decl_type(type, ptr))) error("Functions cannot return vectors");
+            if (decl_type(type, ptr) == STRUCTOBJ) error("Functions cannot return structs");
             struct function *func = lookup_func(name);
             if (!func) func = add_function(name);
+            curfunc = func->name;
             if (func->defined) error("Function already defined");
             func->defined = 1;
             
-            emit(".globl %s", name);
-            emit("%s:", name);
             token = gettoken();
             param_offset = 16;  /* Reset parameter offset */
             function(type);
         } else {
-            global_declaration(type);
+            global_declaration(name, type, ptr, tag, isconst && !ptr);
         }
     }
 }
 
-void global_declaration(int type) {
-    /* Global variable already parsed */
-    char name[NAMESIZE];
-    if (!tokstr) {
-        error("Internal error: null token string");
-        return;
-    }
-    strcpy(name, tokstr);
-    
-    int size = 0;
-    if (token == '[') {
+/* One initializer value: a number or character, possibly negated */
+int const_value(void) {
+    int neg = 0, val;
+    if (token == '-') {
+        neg = 1;
         token = gettoken();
-        if (token != T_NUMBER) error("Expected array size");
-        size = tokval;
-        if (size <= 0) {
-            error("Array size must be positive");
-            size = 1;
-        }
-        if (size > 65536) {
-            error("Array size too large");
-            size = 65536;
+    }
+    if (token != T_NUMBER && token != T_CHARLIT) error("Expected constant initializer");
+    val = tokval;
+    token = gettoken();
+    return neg ? -val : val;
+}
+
+/*
+ * { v, v, ... } for an array of size elements, or of as many as there
+ * are values if size is 0. Elements are 8 bytes, char tables included,
+ * since all arrays are indexed that way; missing ones are zero. A 2-D
+ * array may give each row as a nested { ... }, which is padded to cols.
+ */
+int brace_initializer(int size, int cols) {
+    int n = 0;
+    token = gettoken();
+    while (token != '}') {
+        if (size && n >= size) error("Too many initializers");
+        if (cols && token == '{') {
+            int k = 0;
+            if (n % cols) error("Row initializer must start a row");
+            token = gettoken();
+            while (token != '}') {
+                if (k >= cols) error("Too many initializers");
+                emit("  .quad %d", const_value());
+                k++;
+                if (token != ',') break;
+                token = gettoken();
+            }
+            if (token != '}') error("Expected }");
+            token = gettoken();
+            if (k < cols) emit("  .zero %d", (cols - k) * 8);
+            n += cols;
+        } else {
+            emit("  .quad %d", const_value());
+            n++;
         }
+        if (token != ',') break;
         token = gettoken();
-        if (token != ']') error("Expected ]");
+    }
+    if (token != '}') error("Expected }");
+    token = gettoken();
+    if (!n) error("Empty initializer list");
+    if (!size && cols) size = (n + cols - 1) / cols * cols;
+    if (size > n) emit("  .zero %d", (size - n) * 8);
+    return size ? size : n;
+}
+
+void global_declaration(char *name, int type, int ptr, int tag, int isconst) {
+    /* Name already parsed; tokstr may hold a later identifier. An empty
+     * [] takes its size from the initializer */
+    int size = 0, unsized = 0, cols = 0;
+    if (token == '[') {
         token = gettoken();
+        if (token == ']') {
+            unsized = 1;
+            token = gettoken();
+        } else {
+            size = array_dim();
+        }
+        cols = array_cols(size);
+        if (cols) size *= cols;
     }
     
-    struct symbol *sym = add_symbol(name, type == T_CHAR ? 1 : 0, size);
+    int align = parse_aligned();
+    struct symbol *sym = add_symbol(name, decl_type(type, ptr), size, tag, align);
+    sym->isconst = isconst;
+    sym->cols = cols;
+    if (unsized && token != '=') error("Array size needed without an initializer");
     
-    /* Handle initialization */
-    if (token == '=') {
+    if (sym->type == STRUCTOBJ) {
+        if (!structs[tag].defined) error("Variable of incomplete struct type");
+        if (token == '=') error("Struct globals cannot be initialized");
+        if (isconst) error("Const structs not supported");
+        emit_global_label(name, align > structs[tag].align ? align : structs[tag].align, 0);
+        emit("  .zero %d", type_size(STRUCTOBJ, tag, size));
+        emit(".text");
+    } else if (isvec(sym->type)) {
+        if (size > 0) error("Arrays of vectors not supported");
+        if (token == '=') error("Vector globals cannot be initialized");
+        if (isconst) error("Const vectors not supported");
+        emit_global_label(name, align > 16 ? align : 16, 0);
+        emit("  .zero 16");
+        emit(".text");
+    } else if (token == '=') {
         token = gettoken();
-        emit(".data");
-        emit(".globl %s", name);
-        emit("%s:", name);
+        emit_global_label(name, align, isconst);
         
-        if (token == T_STRING && type == T_CHAR && size > 0) {
-            /* String initialization for char array */
-            emit("  .ascii \"%s\"", tokstr);
-            emit("  .zero %d", size - strlen(tokstr) - 1);
-            token = gettoken();
-        } else if (token == T_NUMBER || token == T_CHARLIT) {
-            emit("  .quad %d", tokval);
+        if (token == T_STRING && sym->type == 1 && !cols && (size > 0 || unsized)) {
+            /* String initialization for char array. The bytes are packed
+             * for the string functions, not 8 apart as [] reads them, so
+             * [] does not size it */
+            if (unsized) error("Array size needed for a string initializer");
+            if (toklen > size) error("Initializer string too long");
+            emit_string(".ascii", tokstr, toklen);
+            emit("  .zero %d", size - toklen);
             token = gettoken();
+        } else if (token == '{' && (size > 0 || unsized)) {
+            size = brace_initializer(size, cols);
+        } else if (size == 0 && !unsized) {
+            sym->value = const_value();
+            emit("  .quad %d", sym->value);
         } else {
             error("Invalid initializer");
         }
+        sym->size = size;
+        sym->isarray = size > 0;
         emit(".text");
     } else {
         /* Uninitialized global */
-        emit(".data");
-        emit(".globl %s", name);
-        emit("%s:", name);
+        emit_global_label(name, align, isconst);
         if (size > 0) {
-            emit("  .space %d", size * (type == T_CHAR ? 1 : 8));
+            emit("  .space %d", size * (sym->type == 1 ? 1 : 8));
         } else {
             emit("  .quad 0");
         }
@@ -626,11 +2230,16 @@ void parameter_list(void) {
     int param_count = 0;
     
     while (token != ')') {
-        int type = T_INT;
-        if (token == T_INT || token == T_CHAR) {
+        int type = T_INT, tag = -1, ptr;
+        if (token == T_CONST) token = gettoken();
+        if (is_type(token)) {
             type = token;
             token = gettoken();
+            if (type == T_STRUCT) tag = struct_decl();
         }
+        ptr = parse_stars();
+        if (isvec(decl_type(type, ptr))) error("Vector parameters not supported");
+        if (decl_type(type, ptr) == STRUCTOBJ) error("Struct parameters must be pointers");
         
         if (token != T_IDENT) error("Expected parameter name");
         
@@ -643,7 +2252,7 @@ void parameter_list(void) {
             break;
         }
         
-        add_symbol(tokstr, type == T_CHAR ? 1 : 0, 0);
+        add_symbol(tokstr, decl_type(type, ptr), 0, tag, 0);
         
         if (func) {
             func->param_types[param_count] = type;
@@ -663,77 +2272,647 @@ void parameter_list(void) {
     }
 }
 
-void function(int type) {
-    /* Parse parameters */
-    parameter_list();
-    token = gettoken();
-    
-    if (token != '{') error("Expected {");
-    token = gettoken();
-    
-    /* Function prologue */
-    if (target == TARGET_X64) {
-        emit("  pushq %%rbp");
-        emit("  movq %%rsp, %%rbp");
-        /* Save argument registers */
-        if (param_offset > 16) {
-            emit("  pushq %%rdi");
-            if (param_offset > 24) emit("  pushq %%rsi");
-            if (param_offset > 32) emit("  pushq %%rdx");
-            if (param_offset > 40) emit("  pushq %%rcx");
-            if (param_offset > 48) emit("  pushq %%r8");
-            if (param_offset > 56) emit("  pushq %%r9");
-        }
-    } else {
-        emit("  stp x29, x30, [sp, #-16]!");
-        emit("  mov x29, sp");
-        /* Save argument registers */
-        int nparams = (param_offset - 16) / 8;
-        if (nparams > 0) {
-            for (int i = 0; i < nparams && i < 8; i++) {
-                emit("  str x%d, [sp, #-16]!", i);
-            }
+/* Return from the function. The unwind rules change only until the ret;
+ * the code after it still runs in the frame. */
+void emit_epilogue(void) {
+    /* An instrumented main returns through exit(), which writes the
+     * profile; _start knows nothing of it */
+    if (profile_gen && !strcmp(curfunc, "main")) {
+        if (target == TARGET_X64) {
+            emit("  movq %%rax, %%rdi");
+            emit("  call exit");
+        } else {
+            emit("  bl exit");
+        }
+    }
+    emit(".cfi_remember_state");
+    if (target == TARGET_X64) {
+        emit("  movq %%rbp, %%rsp");
+        emit("  popq %%rbp");
+        emit(".cfi_def_cfa %%rsp, 8");
+        emit("  ret");
+    } else {
+        emit("  mov sp, x29");
+        emit("  ldp x29, x30, [sp], #16");
+        emit(".cfi_def_cfa sp, 0");
+        emit(".cfi_restore x29");
+        emit(".cfi_restore x30");
+        emit("  ret");
+    }
+    emit(".cfi_restore_state");
+}
+
+/* Bytes of stack the function uses below its caller's sp: the return
+ * address, the saved frame, arguments and locals, and the deepest the
+ * expression stack gets. The code is straight-line but for branches
+ * that leave the expression stack as they found it, so one pass over it
+ * will do; code after a ret runs in the frame again, as the CFI says. */
+int frame_size(void) {
+    int i, n, len, depth = target == TARGET_X64 ? 8 : 0, saved = 0, max = 0;
+    char *s;
+    
+    for (i = 0; i < ncode; i++) {
+        s = code[i];
+        len = strlen(s);
+        if (!strcmp(s, ".cfi_remember_state")) {
+            saved = depth;
+        } else if (!strcmp(s, ".cfi_restore_state")) {
+            depth = saved;
+        } else if (target == TARGET_X64) {
+            if (!strncmp(s, "  push", 6)) {
+                depth += 8;
+            } else if (!strncmp(s, "  pop", 5)) {
+                depth -= 8;
+            } else if (len > 6 && !strcmp(s + len - 6, ", %rsp")) {
+                if (sscanf(s, "  subq $%d", &n) == 1) depth += n;
+                else if (sscanf(s, "  addq $%d", &n) == 1) depth -= n;
+                else if (!strcmp(s, "  movq %rbp, %rsp")) depth = 16;
+            }
+        } else {
+            if (strstr(s, "[sp, #-16]!")) {
+                depth += 16;
+            } else if (strstr(s, "[sp], #16")) {
+                depth -= 16;
+            } else if (sscanf(s, "  sub sp, sp, #%d", &n) == 1) {
+                depth += n;
+            } else if (sscanf(s, "  add sp, sp, #%d", &n) == 1) {
+                depth -= n;
+            } else if (!strcmp(s, "  mov sp, x29")) {
+                depth = 16;
+            }
+        }
+        if (depth > max) max = depth;
+    }
+    return max;
+}
+
+/* Record the frame size of the finished function: a line of the
+ * -fstack-usage report, an entry of .stack_sizes (its address and the
+ * size as ULEB128, the layout other tools read too) */
+void stack_usage(struct function *func, int line) {
+    func->frame = frame_size();
+    if (stack_report) {
+        fprintf(stack_report, "%s:%d:%s\t%d\tstatic\n", filename, line, curfunc, func->frame);
+    }
+    if (stack_section) {
+        emit(".pushsection .stack_sizes,\"\",@progbits");
+        emit("  .quad %s", curfunc);
+        emit("  .uleb128 %d", func->frame);
+        emit(".popsection");
+    }
+}
+
+/* Index of the .cfi_endproc that closes the rows, n if there is none;
+ * code moved to the end of a function goes before it */
+int body_end(char **rows, int *order, int n) {
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        if (!strcmp(rows[order ? order[i] : i], ".cfi_endproc")) return i;
+    }
+    return n;
+}
+
+/* Target of a conditional branch to a compiler label, else NULL */
+char *branch_target(char *s) {
+    char *t;
+    if (target == TARGET_X64) {
+        if (strncmp(s, "  j", 3) || !strncmp(s, "  jmp ", 6)) return NULL;
+    } else {
+        if (strncmp(s, "  cb", 4) && strncmp(s, "  tb", 4) && strncmp(s, "  b.", 4)) {
+            return NULL;
+        }
+    }
+    t = strrchr(s, ' ');
+    if (t[1] != 'L' || !isdigit(t[2])) return NULL;
+    return t + 1;
+}
+
+/* Bump counter nprof, recording what it counts */
+void profile_count(int kind, int id) {
+    struct profrec *r;
+    int off = nprof * 8;
+    
+    GROW(&perm_arena, profrecs, nprof, maxprof);
+    r = &profrecs[nprof++];
+    r->func = curfunc;
+    r->kind = kind;
+    r->id = id;
+    if (target == TARGET_X64) {
+        emit("  incq Lprof_cnt+%d(%%rip)", off);
+    } else {
+        emit("  adrp x16, Lprof_cnt");
+        emit("  add x16, x16, :lo12:Lprof_cnt");
+        emit("  ldr x17, [x16, #%d]", off);
+        emit("  add x17, x17, #1");
+        emit("  str x17, [x16, #%d]", off);
+    }
+}
+
+/* The stubs counting the taken edges */
+void emit_stubs(int *stublab, int *stubto, int *stubid, int nstub) {
+    int i;
+    for (i = 0; i < nstub; i++) {
+        emit("L%d:", stublab[i]);
+        profile_count('T', stubid[i]);
+        emit_jump(stubto[i]);
+    }
+}
+
+/*
+ * -fprofile-generate: rewrite the finished body with a counter at the
+ * entry and after every label, and on both edges of every conditional
+ * branch. The not-taken edge is counted right after the branch; the
+ * branch itself is redirected to a stub after the body that counts the
+ * taken edge and jumps on. Nothing is inserted inside an exclusive
+ * load/store pair, where a memory access could make it fail forever.
+ */
+void profile_code(void) {
+    int i, n = ncode, nstub = 0, block = 0, branch = 0, excl = 0, end;
+    char **body = arena_alloc(&func_arena, n * sizeof(char *));
+    int *bodyline = arena_alloc(&func_arena, n * sizeof(int));
+    int *stublab = arena_alloc(&func_arena, n * sizeof(int));
+    int *stubto = arena_alloc(&func_arena, n * sizeof(int));
+    int *stubid = arena_alloc(&func_arena, n * sizeof(int));
+    char *entry = arena_printf(&func_arena, "%s:", curfunc);
+    char *s, *t;
+    
+    vn_clear();     /* entries refer to code positions about to move */
+    memcpy(body, code, n * sizeof(char *));
+    memcpy(bodyline, codeline, n * sizeof(int));
+    end = body_end(body, NULL, n);
+    ncode = 0;
+    for (i = 0; i < n; i++) {
+        if (i == end) emit_stubs(stublab, stubto, stubid, nstub);
+        s = body[i];
+        if (!s[0]) continue;
+        keep_line = bodyline[i];    /* counters share the line of the row */
+        if (!strncmp(s, "  ldaxr ", 8)) excl = 1;
+        if (!strncmp(s, "  stlxr ", 8)) excl = 0;
+        if (!excl && (t = branch_target(s))) {
+            stublab[nstub] = lab++;
+            stubto[nstub] = atoi(t + 1);
+            stubid[nstub] = branch;
+            emit("%.*sL%d", (int)(t - s), s, stublab[nstub++]);
+            profile_count('N', branch++);
+            continue;
+        }
+        emit("%s", s);
+        if (!strcmp(s, entry)) {
+            profile_count('B', 0);
+        } else if (!excl && s[0] == 'L' && isdigit(s[1])) {
+            profile_count('B', ++block);
+        }
+    }
+    if (end == n) emit_stubs(stublab, stubto, stubid, nstub);
+    keep_line = 0;
+}
+
+/*
+ * The counters, zeroed in .bss, and the table the runtime writes them
+ * out from at exit: a link to the next unit's table and a registered
+ * flag, both set by _prof_register, the number of counters, their
+ * address, and for each the function name, the kind and the id.
+ */
+void emit_profile_table(void) {
+    int i, fn = 0;
+    
+    emit("");
+    emit(".bss");
+    emit("  .balign 8");
+    emit("Lprof_cnt:");
+    emit("  .zero %d", nprof ? nprof * 8 : 8);
+    emit(".section .rodata");
+    for (i = 0; i < nprof; i++) {
+        if (i && !strcmp(profrecs[i].func, profrecs[i - 1].func)) continue;
+        emit("Lprof_fn%d:", i);
+        emit_string(".asciz", profrecs[i].func, strlen(profrecs[i].func));
+    }
+    emit(".data");
+    emit("  .balign 8");
+    emit("Lprof_tab:");
+    emit("  .quad 0, 0");
+    emit("  .quad %d", nprof);
+    emit("  .quad Lprof_cnt");
+    for (i = 0; i < nprof; i++) {
+        if (i && strcmp(profrecs[i].func, profrecs[i - 1].func)) fn = i;
+        emit("  .quad Lprof_fn%d, %d, %d", fn, profrecs[i].kind, profrecs[i].id);
+    }
+}
+
+/* Next blank-separated word of f, kept for the whole run; NULL at the end */
+char *read_word(FILE *f) {
+    char *w = NULL;
+    int n = 0, cap = 0, c;
+    
+    while ((c = getc(f)) != EOF && isspace(c));
+    while (c != EOF && !isspace(c)) {
+        GROW(&perm_arena, w, n + 1, cap);
+        w[n++] = c;
+        c = getc(f);
+    }
+    if (w) w[n] = '\0';
+    return w;
+}
+
+/* -fprofile-use: read the counts a -fprofile-generate build wrote */
+void load_profile(char *path) {
+    FILE *f = fopen(path, "r");
+    struct profrec r;
+    char kind;
+    
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    memset(profhash, -1, sizeof(profhash));
+    while ((r.func = read_word(f)) &&
+           fscanf(f, " %c %d %ld", &kind, &r.id, &r.count) == 3) {
+        r.kind = kind;
+        r.next = -1;
+        if (!nprof || strcmp(r.func, profrecs[nprof - 1].func)) {
+            r.next = profhash[name_hash(r.func)];
+            profhash[name_hash(r.func)] = nprof;
+        }
+        GROW(&perm_arena, profrecs, nprof, maxprof);
+        profrecs[nprof++] = r;
+        if (r.count > profile_max) profile_max = r.count;
+    }
+    fclose(f);
+}
+
+/* Find the records of the current function, which the profile keeps
+ * together, in prof_lo to prof_hi */
+void profile_func(void) {
+    int i;
+    
+    prof_lo = prof_hi = 0;
+    for (i = profhash[name_hash(curfunc)]; i >= 0; i = profrecs[i].next) {
+        if (strcmp(profrecs[i].func, curfunc)) continue;
+        prof_lo = prof_hi = i;
+        while (prof_hi < nprof && !strcmp(profrecs[prof_hi].func, curfunc)) prof_hi++;
+        return;
+    }
+}
+
+/* Count of a counter of the current function, -1 if not in the profile */
+long profile_lookup(int kind, int id) {
+    int i;
+    for (i = prof_lo; i < prof_hi; i++) {
+        if (profrecs[i].kind == kind && profrecs[i].id == id) {
+            return profrecs[i].count;
+        }
+    }
+    return -1;
+}
+
+char *inverse_cond[][2] = {
+    {"jz", "jnz"}, {"je", "jne"}, {"jl", "jge"}, {"jg", "jle"},
+    {"jb", "jae"}, {"ja", "jbe"}, {"js", "jns"},
+    {"cbz", "cbnz"}, {"tbz", "tbnz"}, {"b.eq", "b.ne"}, {"b.lt", "b.ge"},
+    {"b.gt", "b.le"}, {"b.lo", "b.hs"}, {"b.hi", "b.ls"}, {"b.mi", "b.pl"}
+};
+
+/* The conditional branch s with the opposite condition and label n as
+ * target; NULL if the condition is not known */
+char *invert_branch(char *s, int n) {
+    char *args = s + 2, *t = branch_target(s), *inv;
+    size_t len = strcspn(args, " ");
+    int i;
+    
+    for (i = 0; i < (int)(sizeof(inverse_cond) / sizeof(inverse_cond[0])); i++) {
+        inv = NULL;
+        if (strlen(inverse_cond[i][0]) == len && !strncmp(args, inverse_cond[i][0], len)) {
+            inv = inverse_cond[i][1];
+        } else if (strlen(inverse_cond[i][1]) == len && !strncmp(args, inverse_cond[i][1], len)) {
+            inv = inverse_cond[i][0];
+        }
+        if (inv) {
+            return arena_printf(&func_arena, "  %s%.*sL%d", inv, (int)(t - args - len), args + len, n);
+        }
+    }
+    return NULL;
+}
+
+/* Control never falls through past s */
+int unconditional(char *s) {
+    return !strncmp(s, "  jmp ", 6) || !strncmp(s, "  b ", 4) || !strcmp(s, "  ret");
+}
+
+/* The frame the cold part of a function runs in, as its own FDE */
+void emit_cold_frame(void) {
+    emit(".type %s.cold, %cfunction", curfunc, target == TARGET_X64 ? '@' : '%');
+    emit(".cfi_startproc");
+    if (target == TARGET_X64) {
+        emit(".cfi_def_cfa %%rbp, 16");
+        emit(".cfi_offset %%rbp, -16");
+    } else {
+        emit(".cfi_def_cfa x29, 16");
+        emit(".cfi_offset x29, -16");
+        emit(".cfi_offset x30, -8");
+    }
+    emit("%s.cold:", curfunc);
+}
+
+/*
+ * -fprofile-use: lay out the finished body by the profile. Where a
+ * conditional branch was taken more often than not, the code it skips
+ * is moved after the body and the branch inverted, so the likely path
+ * falls through; skipped code that never ran goes to .text.unlikely
+ * instead. A function that was never called goes to .text.unlikely as a
+ * whole, and one within 1/16 of the hottest count of the program to
+ * .text.hot. Branches are numbered as in profile_code, so the profile
+ * must come from the same source.
+ */
+void profile_layout(void) {
+    char **body, *want, *inv, *section = NULL;
+    int *order, *brid, *moved, *cold, *bodyline;
+    int i, j, k, n = 0, nline, nmoved = 0, ncold = 0, branch = 0, excl = 0;
+    int *list, *nlist, label, end, rows;
+    long entry, taken, fall, fmax = 0;
+    
+    profile_func();
+    entry = profile_lookup('B', 0);
+    if (entry < 0) return;
+    vn_clear();     /* entries refer to code positions about to move */
+    /* Each inverted branch adds at most a label and a jump */
+    rows = 3 * ncode;
+    body = arena_alloc(&func_arena, rows * sizeof(char *));
+    order = arena_alloc(&func_arena, rows * sizeof(int));
+    brid = arena_alloc(&func_arena, rows * sizeof(int));
+    moved = arena_alloc(&func_arena, rows * sizeof(int));
+    cold = arena_alloc(&func_arena, rows * sizeof(int));
+    bodyline = arena_alloc(&func_arena, rows * sizeof(int));
+    for (i = prof_lo; i < prof_hi; i++) {
+        if (profrecs[i].count > fmax) fmax = profrecs[i].count;
+    }
+    if (entry == 0) {
+        section = ".text.unlikely";
+    } else if (fmax * 16 >= profile_max) {
+        section = ".text.hot";
+    }
+    
+    for (i = 0; i < ncode; i++) {
+        if (!code[i][0]) continue;
+        body[n] = code[i];
+        bodyline[n] = codeline[i];
+        if (!strncmp(body[n], "  ldaxr ", 8)) excl = 1;
+        if (!strncmp(body[n], "  stlxr ", 8)) excl = 0;
+        brid[n] = !excl && branch_target(body[n]) ? branch++ : -1;
+        order[n] = n;
+        n++;
+    }
+    nline = n;
+    
+    for (i = 0; entry > 0 && i < n; i++) {
+        if (brid[order[i]] < 0) continue;
+        taken = profile_lookup('T', brid[order[i]]);
+        fall = profile_lookup('N', brid[order[i]]);
+        if (fall < 0 || taken <= fall) continue;
+        
+        /* The skipped code runs from the branch to its target label */
+        want = arena_printf(&func_arena, "%s:", branch_target(body[order[i]]));
+        for (j = i + 1; j < n && strcmp(body[order[j]], want); j++);
+        if (j == n || j == i + 1) continue;
+        label = lab++;
+        if (!(inv = invert_branch(body[order[i]], label))) continue;
+        body[order[i]] = inv;
+        
+        list = fall ? moved : cold;
+        nlist = fall ? &nmoved : &ncold;
+        body[nline] = arena_printf(&func_arena, "L%d:", label);
+        bodyline[nline] = bodyline[order[i + 1]];
+        list[(*nlist)++] = nline++;
+        for (k = i + 1; k < j; k++) list[(*nlist)++] = order[k];
+        for (k = j - 1; k > i + 1 && body[order[k]][0] == '.'; k--);
+        if (!unconditional(body[order[k]])) {
+            want[strlen(want) - 1] = '\0';
+            if (target == TARGET_X64) {
+                body[nline] = arena_printf(&func_arena, "  jmp %s", want);
+            } else {
+                body[nline] = arena_printf(&func_arena, "  b %s", want);
+            }
+            bodyline[nline] = bodyline[order[j - 1]];
+            list[(*nlist)++] = nline++;
+        }
+        memmove(order + i + 1, order + j, (n - j) * sizeof(int));
+        n -= j - i - 1;
+    }
+    
+    /* Moved code stays within the function's FDE; the cold part gets
+     * one of its own, as an FDE cannot span sections */
+    ncode = 0;
+    end = body_end(body, order, n);
+    if (section) emit(".section %s,\"ax\",@progbits", section);
+    for (i = 0; i < end; i++) emit_row(body[order[i]], bodyline[order[i]]);
+    for (i = 0; i < nmoved; i++) emit_row(body[moved[i]], bodyline[moved[i]]);
+    for (i = end; i < n; i++) emit_row(body[order[i]], bodyline[order[i]]);
+    if (ncold) {
+        emit(".section .text.unlikely,\"ax\",@progbits");
+        keep_line = bodyline[cold[0]];
+        emit_cold_frame();
+        keep_line = 0;
+        for (i = 0; i < ncold; i++) emit_row(body[cold[i]], bodyline[cold[i]]);
+        emit(".cfi_endproc");
+        emit(".size %s.cold, .-%s.cold", curfunc, curfunc);
+    }
+    if (section || ncold) emit(".text");
+}
+
+void function(int type) {
+    struct function *func;
+    int nparams, allocat, alloc, headline = lineno;
+    
+    /* Parse parameters */
+    infunc = 1;
+    inparams = 1;
+    parameter_list();
+    inparams = 0;
+    nparams = (param_offset - 16) / 8;
+    if (nparams > nregargs()) nparams = nregargs();     /* saved in the frame */
+    token = gettoken();
+    
+    if (token != '{') error("Expected {");
+    token = gettoken();
+    
+    begin_code();
+    keep_line = headline;       /* the prologue belongs to the header */
+    emit(".globl %s", curfunc);
+    emit(".type %s, %cfunction", curfunc, target == TARGET_X64 ? '@' : '%');
+    emit(".cfi_startproc");
+    emit("%s:", curfunc);
+    
+    /* Function prologue; the CFA is then kept in the frame pointer */
+    if (target == TARGET_X64) {
+        emit("  pushq %%rbp");
+        emit(".cfi_def_cfa_offset 16");
+        emit(".cfi_offset %%rbp, -16");
+        emit("  movq %%rsp, %%rbp");
+        emit(".cfi_def_cfa_register %%rbp");
+        /* Save argument registers */
+        if (param_offset > 16) {
+            emit("  pushq %%rdi");
+            if (param_offset > 24) emit("  pushq %%rsi");
+            if (param_offset > 32) emit("  pushq %%rdx");
+            if (param_offset > 40) emit("  pushq %%rcx");
+            if (param_offset > 48) emit("  pushq %%r8");
+            if (param_offset > 56) emit("  pushq %%r9");
+        }
+    } else {
+        emit("  stp x29, x30, [sp, #-16]!");
+        emit(".cfi_def_cfa_offset 16");
+        emit(".cfi_offset x29, -16");
+        emit(".cfi_offset x30, -8");
+        emit("  mov x29, sp");
+        emit(".cfi_def_cfa_register x29");
+        /* Save argument registers */
+        if (nparams > 0) {
+            for (int i = 0; i < nparams && i < 8; i++) {
+                emit("  str x%d, [sp, #-16]!", i);
+            }
+        }
+    }
+    
+    /* Locals are allocated below the saved arguments; the allocation is
+     * filled in once the deepest block is known, ahead of any code */
+    sp = -nparams * (target == TARGET_X64 ? 8 : 16);
+    lsp = lsp_min = sp;
+    frame_sp = sp;
+    scope_first = 0;
+    allocat = ncode;
+    emit("");
+    keep_line = 0;
+    
+    /* The runtime writes out the counters of every unit that hands it
+     * its table; the first function of the unit to run does, once */
+    if (profile_gen) {
+        if (target == TARGET_X64) {
+            emit("  cmpq $0, Lprof_tab+8(%%rip)");
+            emit("  jne 1f");
+            emit("  leaq Lprof_tab(%%rip), %%rdi");
+            emit("  call _prof_register");
+        } else {
+            emit("  adrp x0, Lprof_tab");
+            emit("  add x0, x0, :lo12:Lprof_tab");
+            emit("  ldr x1, [x0, #8]");
+            emit("  cbnz x1, 1f");
+            emit("  bl _prof_register");
+        }
+        emit("1:");
+    }
+    
+    local_declarations();
+    
+    /* Statements */
+    while (token != '}') {
+        statement();
+    }
+    keep_line = lineno;         /* and the epilogue to the closing brace */
+    token = gettoken();
+    
+    /* Allocate locals */
+    alloc = ((-lsp_min + 15) / 16) * 16;  /* Align to 16 bytes */
+    alloc -= nparams * (target == TARGET_X64 ? 8 : 16);
+    if (alloc > 0) {
+        if (target == TARGET_X64) {
+            code[allocat] = arena_printf(&func_arena, "  subq $%d, %%rsp", alloc);
+        } else {
+            code[allocat] = arena_printf(&func_arena, "  sub sp, sp, #%d", alloc);
         }
     }
     
-    sp = 0;
-    
-    /* Local declarations */
-    while (token == T_INT || token == T_CHAR) {
-        int ltype = token;
+    emit_epilogue();
+    emit(".cfi_endproc");
+    emit(".size %s, .-%s", curfunc, curfunc);
+    keep_line = 0;
+    
+    if (profile_gen) {
+        profile_code();
+    } else if (profile_use) {
+        profile_layout();
+    }
+    func = lookup_func(curfunc);
+    stack_usage(func, headline);
+    func->text_start = wholelen;
+    func->insns = stat_insns;
+    flush_code();
+    func->text_end = wholelen;
+    func->insns = stat_insns - func->insns;
+    
+    /* Reset for next function; its locals and code go with the arena */
+    nlocals = 0;
+    infunc = 0;
+    if (maxlocals > peak_maxlocals) peak_maxlocals = maxlocals;
+    if (maxcode > peak_maxcode) peak_maxcode = maxcode;
+    arena_reset(&func_arena);
+    locals = NULL;
+    maxlocals = 0;
+    code = NULL;
+    codeline = NULL;
+    maxcode = 0;
+}
+
+/* Declarations at the start of a function body or block */
+void local_declarations(void) {
+    while (is_type(token) || token == T_CONST) {
+        int ltype, ltag = -1, ptr, isconst = 0;
+        if (token == T_CONST) {
+            isconst = 1;
+            token = gettoken();
+            if (!is_type(token)) error("Expected type after const");
+        }
+        ltype = token;
         token = gettoken();
+        if (ltype == T_STRUCT) ltag = struct_decl();
         
         while (1) {
+            ptr = parse_stars();
             if (token != T_IDENT) error("Expected identifier");
-            char name[NAMESIZE];
-            strcpy(name, tokstr);
+            char *name = arena_strdup(&func_arena, tokstr);
             token = gettoken();
             
-            int size = 0;
+            int size = 0, cols = 0;
             if (token == '[') {
                 token = gettoken();
-                if (token != T_NUMBER) error("Expected array size");
-                size = tokval;
-                if (size <= 0) {
-                    error("Array size must be positive");
-                    size = 1;
-                }
-                if (size > 65536) {
-                    error("Array size too large");
-                    size = 65536;
-                }
-                token = gettoken();
-                if (token != ']') error("Expected ]");
-                token = gettoken();
+                size = array_dim();
+                cols = array_cols(size);
+                if (cols) size *= cols;
             }
             
-            struct symbol *sym = add_symbol(name, ltype == T_CHAR ? 1 : 0, size);
+            if (decl_type(ltype, ptr) == STRUCTOBJ && !structs[ltag].defined) {
+                error("Variable of incomplete struct type");
+            }
+            int align = parse_aligned();
+            struct symbol *sym = add_symbol(name, decl_type(ltype, ptr), size, ltag, align);
+            sym->isconst = isconst && !ptr;
+            sym->cols = cols;
+            if (isvec(sym->type) && size > 0) {
+                error("Arrays of vectors not supported");
+            }
+            if (aligned_slot(sym)) {
+                /* Round the start of the padded area up */
+                int area = sym->offset + 8 + align - 1;
+                if (target == TARGET_X64) {
+                    emit("  leaq %d(%%rbp), %%rax", area);
+                    emit("  andq $%d, %%rax", -align);
+                } else {
+                    emit("  add x0, x29, #%d", area);
+                    emit("  and x0, x0, #%d", -align);
+                }
+                emit_store_local(sym->offset);
+            }
             
             /* Handle initialization */
             if (token == '=') {
                 token = gettoken();
-                expression();
-                emit_store_local(sym->offset);
+                if (sym->type == STRUCTOBJ) error("Struct locals cannot be initialized");
+                if (isvec(sym->type)) {
+                    vtype = sym->type;
+                    vec_expr(0);
+                    vec_store_var(sym);
+                } else {
+                    expression();
+                    emit_store_var(sym);
+                }
             }
             
             if (token != ',') break;
@@ -743,40 +2922,61 @@ void function(int type) {
         if (token != ';') error("Expected ;");
         token = gettoken();
     }
+}
+
+/* Rewrite a lowered if/else whose arms both assign the same variable:
+ *   cond [0, cond_end)  jz  a [a0, a_end) store [a_end, store_end)
+ *   jmp  label  b [b0, b_end) store
+ * into: cond, push, a, push, b, pop, pop, conditional move, store. */
+void emit_select(int cond_end, int a0, int a_end, int store_end, int b0, int b_end) {
+    int i, n;
     
-    /* Allocate locals */
-    if (sp < 0) {
-        int alloc = ((-sp + 15) / 16) * 16;  /* Align to 16 bytes */
-        if (target == TARGET_X64) {
-            emit("  subq $%d, %%rsp", alloc);
-        } else {
-            emit("  sub sp, sp, #%d", alloc);
-        }
-    }
-    
-    /* Statements */
-    while (token != '}') {
-        statement();
-    }
-    token = gettoken();
-    
-    /* Function epilogue */
+    vn_clear();     /* entries refer to code positions about to move */
+    n = ncode;
     if (target == TARGET_X64) {
-        emit("  movq %%rbp, %%rsp");
-        emit("  popq %%rbp");
-        emit("  ret");
+        emit("  pushq %%rax");
+        for (i = a0; i < a_end; i++) if (code[i][0]) emit_row(code[i], codeline[i]);
+        emit("  pushq %%rax");
+        for (i = b0; i < b_end; i++) if (code[i][0]) emit_row(code[i], codeline[i]);
+        emit("  popq %%rdx");
+        emit("  popq %%rcx");
+        emit("  testq %%rcx, %%rcx");
+        emit("  cmovneq %%rdx, %%rax");
     } else {
-        emit("  mov sp, x29");
-        emit("  ldp x29, x30, [sp], #16");
-        emit("  ret");
+        emit("  str x0, [sp, #-16]!");
+        for (i = a0; i < a_end; i++) if (code[i][0]) emit_row(code[i], codeline[i]);
+        emit("  str x0, [sp, #-16]!");
+        for (i = b0; i < b_end; i++) if (code[i][0]) emit_row(code[i], codeline[i]);
+        emit("  ldr x1, [sp], #16");
+        emit("  ldr x2, [sp], #16");
+        emit("  cmp x2, #0");
+        emit("  csel x0, x1, x0, ne");
     }
+    for (i = a_end; i < store_end; i++) if (code[i][0]) emit_row(code[i], codeline[i]);
     
-    /* Reset for next function */
-    nlocals = 0;
+    memmove(code + cond_end, code + n, (ncode - n) * sizeof(char *));
+    memmove(codeline + cond_end, codeline + n, (ncode - n) * sizeof(int));
+    ncode = cond_end + (ncode - n);
+}
+
+/* Enter a loop that break leaves to label brk and continue to cont */
+void push_loop(int brk, int cont) {
+    int cap = maxwhile;
+    
+    GROW(&perm_arena, breaklab, wsp, cap);
+    GROW(&perm_arena, contlab, wsp, maxwhile);
+    breaklab[wsp] = brk;
+    contlab[wsp] = cont;
+    wsp++;
+    if (wsp > peak_loops) peak_loops = wsp;
 }
 
 void statement(void) {
     int lab1, lab2, lab3;
+    int cond_end, then_start, then_rhs_end, then_end, else_start;
+    struct symbol *then_var;
+    
+    spec_var = NULL;
     
     /* Check for EOF to prevent infinite loops */
     if (token == T_EOF) {
@@ -786,14 +2986,30 @@ void statement(void) {
     
     switch (token) {
         case '{':
-            token = gettoken();
-            while (token != '}' && token != T_EOF) {
-                statement();
-            }
-            if (token == '}') {
+            {
+                /* Locals of the block die at its end, and the next block
+                 * reuses their slots */
+                int first = scope_first, nlive = nlocals, live_sp = lsp, i;
                 token = gettoken();
-            } else {
-                error("Expected }");
+                scope_first = nlocals;
+                local_declarations();
+                while (token != '}' && token != T_EOF) {
+                    statement();
+                }
+                if (token == '}') {
+                    token = gettoken();
+                } else {
+                    error("Expected }");
+                }
+                if (nlocals != nlive) {
+                    vn_clear();
+                    for (i = nlive; i < nlocals; i++) {
+                        if (spec_var == locals[i]) spec_var = NULL;
+                    }
+                }
+                scope_first = first;
+                nlocals = nlive;
+                lsp = live_sp;
             }
             break;
             
@@ -806,19 +3022,38 @@ void statement(void) {
             token = gettoken();
             
             lab1 = lab++;
+            cond_end = ncode;
             emit_branch_false(lab1);
+            then_start = ncode;
             statement();
             
+            /* if (c) v = a; else v = b; with a and b safe to evaluate
+             * unconditionally becomes a conditional move */
+            then_var = NULL;
+            if (spec_var && spec_start == then_start && spec_end == ncode) {
+                then_var = spec_var;
+                then_rhs_end = spec_rhs_end;
+                then_end = ncode;
+            }
+            
             if (token == T_ELSE) {
                 token = gettoken();
                 lab2 = lab++;
                 emit_jump(lab2);
                 emit_label(lab1);
+                else_start = ncode;
                 statement();
-                emit_label(lab2);
+                if (then_var && spec_var == then_var &&
+                    spec_start == else_start && spec_end == ncode) {
+                    emit_select(cond_end, then_start, then_rhs_end, then_end,
+                                else_start, spec_rhs_end);
+                } else {
+                    emit_label(lab2);
+                }
             } else {
                 emit_label(lab1);
             }
+            spec_var = NULL;
             break;
             
         case T_WHILE:
@@ -826,20 +3061,9 @@ void statement(void) {
             if (token != '(') error("Expected (");
             token = gettoken();
             
-            if (wsp >= MAXWHILE) {
-                error("Too many nested loops");
-                /* Skip the while statement */
-                while (token != '}' && token != T_EOF) {
-                    token = gettoken();
-                }
-                break;
-            }
-            
             lab1 = lab++;
             lab2 = lab++;
-            breaklab[wsp] = lab2;
-            contlab[wsp] = lab1;
-            wsp++;
+            push_loop(lab2, lab1);
             
             emit_label(lab1);
             expression();
@@ -859,15 +3083,6 @@ void statement(void) {
             if (token != '(') error("Expected (");
             token = gettoken();
             
-            if (wsp >= MAXWHILE) {
-                error("Too many nested loops");
-                /* Skip the for statement */
-                while (token != '}' && token != T_EOF) {
-                    token = gettoken();
-                }
-                break;
-            }
-            
             /* Initialization */
             if (token != ';') {
                 expression();
@@ -879,9 +3094,7 @@ void statement(void) {
             lab2 = lab++;  /* loop end */
             lab3 = lab++;  /* continue target */
             
-            breaklab[wsp] = lab2;
-            contlab[wsp] = lab3;
-            wsp++;
+            push_loop(lab2, lab3);
             
             emit_label(lab1);
             
@@ -893,44 +3106,27 @@ void statement(void) {
             if (token != ';') error("Expected ;");
             token = gettoken();
             
-            /* Save increment expression position */
-            char *inc_start = lptr;
-            int inc_line = lineno;
-            
-            /* Skip increment expression */
-            int paren = 1;
-            while (paren > 0 && *lptr) {
-                if (*lptr == '(') paren++;
-                else if (*lptr == ')') paren--;
-                if (*lptr == '\n') lineno++;
-                if (paren > 0) lptr++;
-            }
-            
-            if (!*lptr) {
-                error("Unexpected end of file in for loop");
-                break;
+            /* The increment is compiled after the body: skip it for now */
+            int inc = token_mark(), paren = 1;
+            while (token != T_EOF) {
+                if (token == '(') paren++;
+                if (token == ')' && !--paren) break;
+                token = gettoken();
             }
-            
-            if (token != ')') error("Expected )");
-            token = gettoken();
+            if (token != ')') error("Unexpected end of file in for loop");
+            token = gettoken();
             
             /* Body */
             statement();
             
             /* Continue label and increment */
             emit_label(lab3);
-            if (inc_start != lptr - 1) {
-                /* Restore position for increment */
-                char saved = *lptr;
-                *lptr = '\0';
-                char *save_lptr = lptr;
-                lptr = inc_start;
-                int save_line = lineno;
-                lineno = inc_line;
+            if (ts->kind[inc] != ')') {
+                int resume = token_mark();
+                token_seek(inc);
                 expression();
-                *save_lptr = saved;
-                lptr = save_lptr;
-                lineno = save_line;
+                if (token != ')') error("Expected )");
+                token_seek(resume);
             }
             
             emit_jump(lab1);
@@ -953,16 +3149,7 @@ void statement(void) {
             }
             if (token != ';') error("Expected ;");
             token = gettoken();
-            
-            if (target == TARGET_X64) {
-                emit("  movq %%rbp, %%rsp");
-                emit("  popq %%rbp");
-                emit("  ret");
-            } else {
-                emit("  mov sp, x29");
-                emit("  ldp x29, x30, [sp], #16");
-                emit("  ret");
-            }
+            emit_epilogue();
             break;
             
         case T_BREAK:
@@ -981,46 +3168,502 @@ void statement(void) {
             emit_jump(contlab[wsp-1]);
             break;
             
+        case T_ASM:
+            asm_statement();
+            break;
+            
         case ';':
             token = gettoken();
             break;
             
         default:
-            expression();
-            if (token != ';') error("Expected ;");
+            {
+                int start = ncode;
+                int unsafe = unsafe_ops;
+                
+                asg_var = NULL;
+                expression();
+                if (token != ';') error("Expected ;");
+                token = gettoken();
+                
+                /* Only the final store may be unsafe */
+                if (asg_var && asg_start == start && unsafe_ops == unsafe + 1) {
+                    spec_var = asg_var;
+                    spec_start = start;
+                    spec_rhs_end = asg_rhs_end;
+                    spec_end = ncode;
+                }
+            }
+    }
+}
+
+/*
+ * Inline assembly: asm("template" : outputs : inputs);
+ * An operand is "reg"(x), bound to the named register, or "r"(x), bound
+ * to a free scratch register. Outputs are scalar variables marked "=" or,
+ * if also read, "+"; inputs are any expression. In the template %N is the
+ * register of operand N, outputs numbered first, and %% a literal %.
+ * Without a colon the template is copied as is. The template may use any
+ * caller-saved register but must leave the frame and stack as it found
+ * them.
+ */
+int asm_reg_used(char **reg, int n, char *r) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!strcmp(reg[i], r)) return 1;
+    }
+    return 0;
+}
+
+void asm_statement(void) {
+    char *tmpl = NULL, *text, *reg[MAXASMOPS];
+    struct operand ops[MAXASMOPS];
+    int spill[MAXASMOPS], rw[MAXASMOPS];
+    int nops = 0, nout = 0, extended = 0, base = sp, len = 0, cap = 0, widest = 1;
+    int npool = target == TARGET_X64 ? 9 : 16;
+    char **pool = target == TARGET_X64 ? asmregs_x64 : asmregs_arm64;
+    int i, j, n, mark;
+    char *p, *q;
+    
+    whole_asm = 1;
+    token = gettoken();
+    if (token == T_IDENT && !strcmp(tokstr, "volatile")) token = gettoken();
+    if (token != '(') error("Expected (");
+    token = gettoken();
+    if (token != T_STRING) error("Expected asm template string");
+    while (token == T_STRING) {     /* adjacent literals are joined */
+        GROW(&func_arena, tmpl, len + toklen, cap);
+        memcpy(tmpl + len, tokstr, toklen);
+        len += toklen;
+        token = gettoken();
+    }
+    tmpl[len] = '\0';
+    
+    /* Outputs, then inputs; complex inputs are spilled like arguments */
+    for (n = 0; n < 2 && token == ':'; n++) {
+        extended = 1;
+        token = gettoken();
+        while (token == T_STRING) {
+            if (nops >= MAXASMOPS) error("Too many asm operands");
+            p = tokstr;
+            rw[nops] = 0;
+            spill[nops] = 0;
+            if (n == 0) {
+                if (*p != '=' && *p != '+') error("asm output needs = or +");
+                rw[nops] = *p++ == '+';
+            }
+            if (!*p) error("Expected asm register");
+            if (target == TARGET_X64 && *p != '%' && strcmp(p, "r")) {
+                reg[nops] = arena_printf(&func_arena, "%%%s", p);
+            } else {
+                reg[nops] = arena_strdup(&func_arena, p);
+            }
+            token = gettoken();
+            if (token != '(') error("Expected (");
+            token = gettoken();
+            if (n == 0) {
+                struct symbol *sym = token == T_IDENT ? lookup(tokstr) : NULL;
+                if (!sym || sym->isarray) {
+                    error("asm output must be a scalar variable");
+                }
+                ops[nops].kind = OP_VAR;
+                ops[nops].sym = sym;
+                token = gettoken();
+                nout++;
+            } else {
+                mark = ncode;
+                expression();
+                ops[nops] = simple_operand(mark);
+                if (ops[nops].kind != OP_NONE) {
+                    ncode = mark;
+                } else {
+                    push();
+                    spill[nops] = sp;
+                }
+            }
+            if (token != ')') error("Expected )");
+            token = gettoken();
+            nops++;
+            if (token != ',') break;
             token = gettoken();
+        }
+    }
+    if (token != ')') error("Expected )");
+    token = gettoken();
+    if (token != ';') error("Expected ;");
+    token = gettoken();
+    
+    /* Named registers are fixed, "r" operands take what is left */
+    for (i = 0; i < nops; i++) {
+        if (strcmp(reg[i], "r")) continue;
+        for (j = 0; j < npool && asm_reg_used(reg, nops, pool[j]); j++)
+            ;
+        if (j == npool) error("Out of registers for asm operands");
+        reg[i] = pool[j];
+    }
+    
+    /* The template may use the value-numbering registers */
+    vn_clear();
+    
+    for (i = nout; i < nops; i++) {
+        if (spill[i]) load_arg(&ops[i], spill[i], reg[i]);
+    }
+    for (i = 0; i < nops; i++) {
+        if ((i >= nout && !spill[i]) || rw[i]) emit_operand_to(&ops[i], reg[i]);
+    }
+    release_stack(base);
+    
+    /* One emitted line per template line; a template character becomes
+     * at most one register name */
+    for (i = 0; i < nops; i++) {
+        if ((int)strlen(reg[i]) > widest) widest = strlen(reg[i]);
+    }
+    text = arena_alloc(&func_arena, (size_t)len * widest + 1);
+    p = tmpl;
+    while (*p) {
+        q = text;
+        while (*p && *p != '\n') {
+            if (extended && *p == '%') {
+                p++;
+                if (isdigit(*p)) {
+                    if (*p - '0' >= nops) error("asm operand number out of range");
+                    strcpy(q, reg[*p++ - '0']);
+                    q += strlen(q);
+                    continue;
+                }
+                if (*p != '%') error("Expected %N or %% in asm template");
+            }
+            *q++ = *p++;
+        }
+        *q = '\0';
+        if (*p) p++;
+        for (q = text; *q == ' ' || *q == '\t'; q++)
+            ;
+        if (!*q) continue;
+        emit("  %s", q);
+    }
+    
+    for (i = 0; i < nout; i++) emit_store_reg(ops[i].sym, reg[i]);
+    unsafe_ops++;
+    vn_clear();
+    lastop_at = -1;
+}
+
+/*
+ * Vector expressions over vchar16 (16 byte lanes) and vint2 (2 int
+ * lanes), evaluated like scalar ones with %xmm0 or v16 as the
+ * accumulator and 16-byte pushes. Operators are + - & | ^ and the lane
+ * compares ==, < and > (signed, vchar16 only), which give all-ones or
+ * zero lanes. Terms are vector variables, __builtin_vload(p), an
+ * unaligned load, and __builtin_vsplat(x), x in every lane. Both
+ * targets' baselines (SSE2, NEON) cover everything used.
+ */
+int vec_level(int tok) {
+    switch (tok) {
+        case '|': return 0;
+        case '^': return 1;
+        case '&': return 2;
+        case T_EQ: case '<': case '>': return 3;
+        case '+': case '-': return 4;
+    }
+    return -1;
+}
+
+/* Lane type of the expression, vchar16 unless a variable said otherwise */
+int vec_type(void) {
+    if (!vtype) vtype = VCHAR16;
+    return vtype;
+}
+
+void vec_load_var(struct symbol *sym, int tmp) {
+    int local = sym->isparam || sym->offset < 0;
+    if (!vtype) vtype = sym->type;
+    if (sym->type != vtype) error("Vector type mismatch");
+    vlast_at = ncode;
+    if (target == TARGET_X64) {
+        if (local) emit("  movdqu %d(%%rbp), %%xmm%d", sym->offset, tmp);
+        else emit("  movdqu %s(%%rip), %%xmm%d", sym->name, tmp);
+    } else {
+        if (local) {
+            emit("  ldr q%d, [x29, #%d]", 16 + tmp, sym->offset);
+        } else {
+            emit("  adrp x16, %s", sym->name);
+            emit("  ldr q%d, [x16, :lo12:%s]", 16 + tmp, sym->name);
+        }
+    }
+    vlast_end = ncode;
+    vlastsym = sym;
+}
+
+void vec_store_var(struct symbol *sym) {
+    if (sym->isparam || sym->offset < 0) {
+        if (target == TARGET_X64) {
+            emit("  movdqu %%xmm0, %d(%%rbp)", sym->offset);
+        } else {
+            emit("  str q16, [x29, #%d]", sym->offset);
+        }
+    } else if (target == TARGET_X64) {
+        emit("  movdqu %%xmm0, %s(%%rip)", sym->name);
+    } else {
+        emit("  adrp x16, %s", sym->name);
+        emit("  str q16, [x16, :lo12:%s]", sym->name);
+    }
+    unsafe_ops++;
+}
+
+void vec_push(void) {
+    if (target == TARGET_X64) {
+        emit("  subq $16, %%rsp");
+        emit("  movdqu %%xmm0, (%%rsp)");
+    } else {
+        emit("  str q16, [sp, #-16]!");
+    }
+    sp -= 16;
+}
+
+void vec_pop(void) {
+    if (target == TARGET_X64) {
+        emit("  movdqu (%%rsp), %%xmm1");
+        emit("  addq $16, %%rsp");
+    } else {
+        emit("  ldr q17, [sp], #16");
+    }
+    sp += 16;
+}
+
+/* Accumulator = left op right, with the left operand in the temporary
+ * register if swapped, else in the accumulator */
+void vec_op(int op, int swapped) {
+    int l = swapped, r = !swapped, res = l;
+    int bytes = vec_type() == VCHAR16;
+    
+    if ((op == '<' || op == '>') && !bytes) error("Ordering compare needs vchar16");
+    if (target == TARGET_X64) {
+        char sfx = bytes ? 'b' : 'q';
+        switch (op) {
+            case '+': emit("  padd%c %%xmm%d, %%xmm%d", sfx, r, l); break;
+            case '-': emit("  psub%c %%xmm%d, %%xmm%d", sfx, r, l); break;
+            case '&': emit("  pand %%xmm%d, %%xmm%d", r, l); break;
+            case '|': emit("  por %%xmm%d, %%xmm%d", r, l); break;
+            case '^': emit("  pxor %%xmm%d, %%xmm%d", r, l); break;
+            case '>': emit("  pcmpgtb %%xmm%d, %%xmm%d", r, l); break;
+            case '<': emit("  pcmpgtb %%xmm%d, %%xmm%d", l, r); res = r; break;
+            case T_EQ:
+                if (bytes) {
+                    emit("  pcmpeqb %%xmm%d, %%xmm%d", r, l);
+                } else {
+                    /* no pcmpeqq in SSE2: both halves must match */
+                    emit("  pcmpeqd %%xmm%d, %%xmm%d", r, l);
+                    emit("  pshufd $0xb1, %%xmm%d, %%xmm2", l);
+                    emit("  pand %%xmm2, %%xmm%d", l);
+                }
+                break;
+        }
+        if (res) emit("  movdqa %%xmm%d, %%xmm0", res);
+    } else {
+        char *arr = bytes ? "16b" : "2d";
+        l += 16;
+        r += 16;
+        switch (op) {
+            case '+': emit("  add v16.%s, v%d.%s, v%d.%s", arr, l, arr, r, arr); break;
+            case '-': emit("  sub v16.%s, v%d.%s, v%d.%s", arr, l, arr, r, arr); break;
+            case '&': emit("  and v16.16b, v%d.16b, v%d.16b", l, r); break;
+            case '|': emit("  orr v16.16b, v%d.16b, v%d.16b", l, r); break;
+            case '^': emit("  eor v16.16b, v%d.16b, v%d.16b", l, r); break;
+            case '>': emit("  cmgt v16.16b, v%d.16b, v%d.16b", l, r); break;
+            case '<': emit("  cmgt v16.16b, v%d.16b, v%d.16b", r, l); break;
+            case T_EQ: emit("  cmeq v16.%s, v%d.%s, v%d.%s", arr, l, arr, r, arr); break;
+        }
+    }
+}
+
+void vec_primary(void) {
+    vlast_at = -1;
+    if (token == '(') {
+        token = gettoken();
+        vec_expr(0);
+        if (token != ')') error("Expected )");
+        token = gettoken();
+    } else if (token == T_IDENT &&
+               (!strcmp(tokstr, "__builtin_vload") || !strcmp(tokstr, "__builtin_vsplat"))) {
+        int load = tokstr[11] == 'l';
+        token = gettoken();
+        if (token != '(') error("Expected (");
+        token = gettoken();
+        expression();
+        if (token != ')') error("Expected )");
+        token = gettoken();
+        if (load) {
+            if (target == TARGET_X64) {
+                emit("  movdqu (%%rax), %%xmm0");
+            } else {
+                emit("  ldr q16, [x0]");
+            }
+            unsafe_ops++;
+        } else if (target == TARGET_X64) {
+            emit("  movq %%rax, %%xmm0");
+            if (vec_type() == VCHAR16) {
+                emit("  punpcklbw %%xmm0, %%xmm0");
+                emit("  pshuflw $0, %%xmm0, %%xmm0");
+            }
+            emit("  punpcklqdq %%xmm0, %%xmm0");
+        } else if (vec_type() == VCHAR16) {
+            emit("  dup v16.16b, w0");
+        } else {
+            emit("  dup v16.2d, x0");
+        }
+    } else if (token == T_IDENT) {
+        struct symbol *sym = lookup(tokstr);
+        if (!sym || !isvec(sym->type)) error("Expected vector operand");
+        token = gettoken();
+        vec_load_var(sym, 0);
+    } else {
+        error("Expected vector operand");
+    }
+}
+
+void vec_expr(int level) {
+    if (level > 4) {
+        vec_primary();
+        return;
+    }
+    vec_expr(level + 1);
+    while (vec_level(token) == level) {
+        int op = token, mark = ncode;
+        token = gettoken();
+        vec_push();
+        vec_expr(level + 1);
+        if (vlast_at == mark + (target == TARGET_X64 ? 2 : 1) && vlast_end == ncode) {
+            /* Right operand was a plain variable: load it beside the
+             * left one instead of round-tripping the stack */
+            struct symbol *sym = vlastsym;
+            ncode = mark;
+            sp += 16;
+            vec_load_var(sym, 1);
+            vec_op(op, 0);
+        } else {
+            vec_pop();
+            vec_op(op, 1);
+        }
+        vlast_at = -1;
+    }
+}
+
+/* __builtin_vmovemask(v): the top bit of each lane, lane 0 in bit 0.
+ * __builtin_vstore(p, v): unaligned store of v to p. */
+int vec_builtin(char *fname) {
+    int save = vtype, base = sp;
+    
+    if (!strcmp(fname, "__builtin_vload") || !strcmp(fname, "__builtin_vsplat")) {
+        error("Vector in scalar expression");
+    }
+    if (!strcmp(fname, "__builtin_vmovemask")) {
+        vtype = 0;
+        vec_expr(0);
+        if (target == TARGET_X64) {
+            emit(vtype == VINT2 ? "  movmskpd %%xmm0, %%eax" : "  pmovmskb %%xmm0, %%eax");
+        } else if (vtype == VINT2) {
+            emit("  ushr v16.2d, v16.2d, #63");
+            emit("  umov x0, v16.d[0]");
+            emit("  umov x1, v16.d[1]");
+            emit("  orr x0, x0, x1, lsl #1");
+        } else {
+            /* gather the 16 sign bits into bytes 0 and 8 */
+            emit("  ushr v16.16b, v16.16b, #7");
+            emit("  usra v16.8h, v16.8h, #7");
+            emit("  usra v16.4s, v16.4s, #14");
+            emit("  usra v16.2d, v16.2d, #28");
+            emit("  umov w0, v16.b[0]");
+            emit("  umov w1, v16.b[8]");
+            emit("  orr w0, w0, w1, lsl #8");
+        }
+    } else if (!strcmp(fname, "__builtin_vstore")) {
+        vtype = 0;
+        expression();
+        push();
+        if (token != ',') error("Expected ,");
+        token = gettoken();
+        vec_expr(0);
+        if (target == TARGET_X64) {
+            pop("%rax");
+            emit("  movdqu %%xmm0, (%%rax)");
+        } else {
+            pop("x0");
+            emit("  str q16, [x0]");
+        }
+        unsafe_ops++;
+        vn_clear();
+    } else {
+        return 0;
     }
+    if (token != ')') error("Expected )");
+    token = gettoken();
+    vtype = save;
+    lastop_at = -1;
+    if (sp != base) error("Internal error: vector stack");
+    return 1;
 }
 
 /* Expression parser - operator precedence */
 void expression(void) {
     assignment();
+    rvalue();
 }
 
 void assignment(void) {
     logical_or();
     
+    if (lval == LV_VAR && isvec(lvsym->type) && token == '=') {
+        struct symbol *dest = lvsym;
+        token = gettoken();
+        lval = LV_NONE;
+        vtype = dest->type;
+        vec_expr(0);
+        vec_store_var(dest);
+        return;
+    }
+    
     while (token == '=' || token == T_PLUSEQ || token == T_MINUSEQ || 
            token == T_STAREQ || token == T_SLASHEQ) {
         int op = token;
-        push();
+        int kind = lval;
+        struct symbol *dest = lvsym;
+        struct operand base = lvbase;
+        int disp = lvdisp, width = lvwidth;
+        
+        int rhs_start;
+        
+        if (kind == LV_NONE) error("Expected lvalue");
+        check_store(kind, dest, &base);
         token = gettoken();
         
-        if (op != '=') {
-            /* Compound assignment: load left side again */
-            if (target == TARGET_X64) {
-                emit("  movq (%%rsp), %%rdx");
-                emit("  movq (%%rdx), %%rax");
-                emit("  pushq %%rax");
-            } else {
-                emit("  ldr x1, [sp]");
-                emit("  ldr x0, [x1]");
-                emit("  str x0, [sp, #-16]!");
+        if (kind == LV_MEM) {
+            lvaddr();
+            lval = LV_NONE;
+            push();
+            if (op != '=') {
+                /* Compound assignment: load left side again */
+                if (target == TARGET_X64) {
+                    emit_mem_load("%rax", "%rax", disp, width);
+                } else {
+                    emit_mem_load("x0", "x0", disp, width);
+                }
+                push();
             }
-            sp -= (target == TARGET_X64 ? 8 : 16);
+        } else if (op != '=') {
+            rvalue();
+            push();
         }
+        lval = LV_NONE;
         
+        rhs_start = ncode;
         assignment();
+        rvalue();
+        if (op == '=' && kind == LV_VAR) {
+            asg_var = dest;
+            asg_start = rhs_start;
+            asg_rhs_end = ncode;
+        }
         
         if (op != '=') {
             /* Perform operation */
@@ -1038,6 +3681,7 @@ void assignment(void) {
                         emit("  movq %%rdx, %%rax");
                         emit("  cqo");
                         emit("  idivq %%rbx");
+                        unsafe_ops++;
                         break;
                 }
             } else {
@@ -1052,12 +3696,20 @@ void assignment(void) {
         }
         
         /* Store result */
-        if (target == TARGET_X64) {
-            pop("%rdx");
-            emit("  movq %%rax, (%%rdx)");
+        if (kind == LV_VAR) {
+            emit_store_var(dest);
+        } else if (kind == LV_FIELD) {
+            emit_field(dest, disp, width, 1);
         } else {
-            pop("x1");
-            emit("  str x0, [x1]");
+            if (target == TARGET_X64) {
+                pop("%rdx");
+                emit_mem_store("%rdx", disp, width);
+            } else {
+                pop("x1");
+                emit_mem_store("x1", disp, width);
+            }
+            unsafe_ops++;
+            vn_store_mem(&base);
         }
     }
 }
@@ -1069,6 +3721,7 @@ void logical_or(void) {
         int lab1 = lab++;
         int lab2 = lab++;
         
+        rvalue();
         if (target == TARGET_X64) {
             emit("  testq %%rax, %%rax");
             emit("  jnz L%d", lab1);
@@ -1078,6 +3731,7 @@ void logical_or(void) {
         
         token = gettoken();
         logical_and();
+        rvalue();
         
         emit_label(lab1);
         if (target == TARGET_X64) {
@@ -1099,6 +3753,7 @@ void logical_and(void) {
         int lab1 = lab++;
         int lab2 = lab++;
         
+        rvalue();
         if (target == TARGET_X64) {
             emit("  testq %%rax, %%rax");
             emit("  jz L%d", lab1);
@@ -1108,6 +3763,7 @@ void logical_and(void) {
         
         token = gettoken();
         bitwise_or();
+        rvalue();
         
         if (target == TARGET_X64) {
             emit("  testq %%rax, %%rax");
@@ -1133,9 +3789,11 @@ void bitwise_or(void) {
     bitwise_xor();
     
     while (token == '|') {
+        rvalue();
         push();
         token = gettoken();
         bitwise_xor();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1151,9 +3809,11 @@ void bitwise_xor(void) {
     bitwise_and();
     
     while (token == '^') {
+        rvalue();
         push();
         token = gettoken();
         bitwise_and();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1169,9 +3829,11 @@ void bitwise_and(void) {
     equality();
     
     while (token == '&') {
+        rvalue();
         push();
         token = gettoken();
         equality();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1188,9 +3850,11 @@ void equality(void) {
     
     while (token == T_EQ || token == T_NE) {
         int op = token;
+        rvalue();
         push();
         token = gettoken();
         relational();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1210,9 +3874,11 @@ void relational(void) {
     
     while (token == '<' || token == '>' || token == T_LE || token == T_GE) {
         int op = token;
+        rvalue();
         push();
         token = gettoken();
         shift();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1242,9 +3908,11 @@ void shift(void) {
     
     while (token == T_SHL || token == T_SHR) {
         int op = token;
+        rvalue();
         push();
         token = gettoken();
         additive();
+        rvalue();
         
         if (target == TARGET_X64) {
             emit("  movq %%rax, %%rcx");
@@ -1263,9 +3931,11 @@ void additive(void) {
     
     while (token == '+' || token == '-') {
         int op = token;
+        rvalue();
         push();
         token = gettoken();
         multiplicative();
+        rvalue();
         
         if (target == TARGET_X64) {
             pop("%rdx");
@@ -1291,9 +3961,12 @@ void multiplicative(void) {
     
     while (token == '*' || token == '/' || token == '%') {
         int op = token;
+        rvalue();
         push();
         token = gettoken();
         unary();
+        rvalue();
+        if (op != '*') unsafe_ops++;
         
         if (target == TARGET_X64) {
             if (op == '*') {
@@ -1324,11 +3997,79 @@ void multiplicative(void) {
     }
 }
 
+/* Increment or decrement the pending lvalue, leaving the new value
+ * (pre) or the old value (post) in the accumulator */
+void incdec(int op, int post) {
+    check_store(lval, lvsym, &lvbase);
+    if (lval == LV_VAR) lvsym->written = 1;
+    unsafe_ops++;
+    if (lval == LV_VAR) {
+        struct symbol *sym = lvsym;
+        if (post) emit_load_var(sym);
+        if (target == TARGET_X64) {
+            if (sym->isparam || sym->offset < 0) {
+                emit("  %sq %d(%%rbp)", op == T_INC ? "inc" : "dec", sym->offset);
+            } else {
+                emit("  %sq %s(%%rip)", op == T_INC ? "inc" : "dec", sym->name);
+            }
+            vn_store_var(sym);
+            if (!post) emit_load_var(sym);
+        } else {
+            if (!post) emit_load_var(sym);
+            if (post) emit("  mov x2, x0");
+            emit("  %s x0, x0, #1", op == T_INC ? "add" : "sub");
+            emit_store_var(sym);
+            if (post) emit("  mov x0, x2");
+        }
+    } else if (lval == LV_MEM) {
+        struct operand base = lvbase;
+        lvaddr();
+        if (target == TARGET_X64) {
+            emit("  movq %%rax, %%rdx");
+            if (post) emit_mem_load("%rax", "%rax", lvdisp, lvwidth);
+            if (lvdisp) {
+                emit("  %s%c %d(%%rdx)", op == T_INC ? "inc" : "dec",
+                     lvwidth == 1 ? 'b' : 'q', lvdisp);
+            } else {
+                emit("  %s%c (%%rdx)", op == T_INC ? "inc" : "dec", lvwidth == 1 ? 'b' : 'q');
+            }
+            if (!post) emit_mem_load("%rax", "%rdx", lvdisp, lvwidth);
+        } else {
+            emit("  mov x1, x0");
+            emit_mem_load("x2", "x1", lvdisp, lvwidth);
+            emit("  %s x0, x2, #1", op == T_INC ? "add" : "sub");
+            emit_mem_store("x1", lvdisp, lvwidth);
+            if (post) emit("  mov x0, x2");
+        }
+        vn_store_mem(&base);
+    } else if (lval == LV_FIELD) {
+        emit_field(lvsym, lvdisp, lvwidth, 0);
+        if (target == TARGET_X64) {
+            if (post) emit("  movq %%rax, %%rcx");
+            emit("  %sq %%rax", op == T_INC ? "inc" : "dec");
+            emit_field(lvsym, lvdisp, lvwidth, 1);
+            if (post) emit("  movq %%rcx, %%rax");
+        } else {
+            if (post) emit("  mov x2, x0");
+            emit("  %s x0, x0, #1", op == T_INC ? "add" : "sub");
+            emit_field(lvsym, lvdisp, lvwidth, 1);
+            if (post) emit("  mov x0, x2");
+        }
+    } else {
+        error("Expected lvalue");
+    }
+    lval = LV_NONE;
+}
+
 void unary(void) {
+    struct operand op;
+    int mark;
+    
     switch (token) {
         case '!':
             token = gettoken();
             unary();
+            rvalue();
             if (target == TARGET_X64) {
                 emit("  testq %%rax, %%rax");
                 emit("  setz %%al");
@@ -1342,6 +4083,7 @@ void unary(void) {
         case '~':
             token = gettoken();
             unary();
+            rvalue();
             if (target == TARGET_X64) {
                 emit("  notq %%rax");
             } else {
@@ -1351,7 +4093,16 @@ void unary(void) {
             
         case '-':
             token = gettoken();
+            mark = ncode;
             unary();
+            rvalue();
+            op = simple_operand(mark);
+            if (op.kind == OP_CONST) {
+                /* Fold negative constants */
+                ncode = mark;
+                emit_load_const(-op.val);
+                break;
+            }
             if (target == TARGET_X64) {
                 emit("  negq %%rax");
             } else {
@@ -1362,34 +4113,36 @@ void unary(void) {
         case '*':
             token = gettoken();
             unary();
-            if (target == TARGET_X64) {
-                emit("  movq (%%rax), %%rax");
-            } else {
-                emit("  ldr x0, [x0]");
-            }
+            rvalue();
+            lval = LV_MEM;
+            lvvn = -1;
+            lvinreg = 1;
+            lvbase.kind = OP_NONE;
+            lvdisp = 0;
+            lvwidth = 8;
             break;
             
         case '&':
             token = gettoken();
-            if (token != T_IDENT) error("Expected identifier");
-            struct symbol *sym = lookup(tokstr);
-            if (!sym) error("Undefined variable");
-            token = gettoken();
-            
-            if (sym->isparam || sym->offset < 0) {
-                if (target == TARGET_X64) {
-                    emit("  leaq %d(%%rbp), %%rax", sym->offset);
-                } else {
-                    emit("  add x0, x29, #%d", sym->offset);
-                }
-            } else {
-                if (target == TARGET_X64) {
-                    emit("  movq $%s, %%rax", sym->name);
-                } else {
-                    emit("  adrp x0, %s", sym->name);
-                    emit("  add x0, x0, :lo12:%s", sym->name);
-                }
+            unary();
+            if (lval == LV_VAR) {
+                lvsym->addrtaken = 1;
+                emit_addr_var(lvsym);
+            } else if (lval == LV_MEM) {
+                lvaddr();
+                emit_add_const(lvdisp);
+            } else if (lval == LV_FIELD) {
+                emit_addr_var(lvsym);
+                emit_add_const(lvdisp);
             }
+            /* Arrays and structs already evaluate to their address */
+            lval = LV_NONE;
+            ekind = ekind == EK_OBJ ? EK_PTR : EK_NONE;
+            break;
+            
+        case T_SIZEOF:
+            token = gettoken();
+            emit_load_const(sizeof_operand());
             break;
             
         case T_INC:
@@ -1398,195 +4151,891 @@ void unary(void) {
                 int op = token;
                 token = gettoken();
                 unary();
-                if (target == TARGET_X64) {
-                    emit("  %sq (%%rax)", op == T_INC ? "inc" : "dec");
-                    emit("  movq (%%rax), %%rax");
-                } else {
-                    emit("  ldr x1, [x0]");
-                    emit("  %s x1, x1, #1", op == T_INC ? "add" : "sub");
-                    emit("  str x1, [x0]");
-                    emit("  mov x0, x1");
-                }
+                incdec(op, 0);
             }
             break;
             
         default:
+            if (token == T_IDENT && !strcmp(tokstr, "offsetof") && !lookup(tokstr)) {
+                token = gettoken();
+                emit_load_const(offsetof_operand());
+                break;
+            }
             postfix();
     }
 }
 
+/* sizeof(type), sizeof(name) or sizeof name */
+int sizeof_operand(void) {
+    int paren = token == '(', n, t, tag = -1, ptr;
+    struct symbol *sym;
+    
+    if (paren) token = gettoken();
+    if (is_type(token)) {
+        t = token;
+        token = gettoken();
+        if (t == T_STRUCT) tag = struct_decl();
+        ptr = parse_stars();
+        t = decl_type(t, ptr);
+        if (t == STRUCTOBJ && !structs[tag].defined) error("sizeof incomplete struct");
+        n = type_size(t, tag, 0);
+    } else {
+        if (token != T_IDENT || !(sym = lookup(tokstr))) error("Expected type or variable");
+        n = type_size(sym->type, sym->tag, sym->size);
+        token = gettoken();
+    }
+    if (paren) {
+        if (token != ')') error("Expected )");
+        token = gettoken();
+    }
+    return n;
+}
+
+/* offsetof(struct tag, field.field...) */
+int offsetof_operand(void) {
+    int tag, off = 0;
+    struct field *f;
+    
+    if (token != '(') error("Expected (");
+    token = gettoken();
+    if (token != T_STRUCT) error("Expected struct type");
+    token = gettoken();
+    tag = struct_decl();
+    if (token != ',') error("Expected ,");
+    while (1) {
+        token = gettoken();
+        if (token != T_IDENT) error("Expected field name");
+        if (tag < 0 || !structs[tag].defined) error("Expected struct field");
+        f = lookup_field(tag, tokstr);
+        off += f->offset;
+        tag = f->type == STRUCTOBJ && !f->count ? f->tag : -1;
+        token = gettoken();
+        if (token != '.') break;
+    }
+    if (token != ')') error("Expected )");
+    token = gettoken();
+    return off;
+}
+
+/* Multiply the accumulator by a constant element size */
+void emit_scale(int size) {
+    int n = 0;
+    while ((1 << n) < size) n++;
+    if ((1 << n) != size) {
+        if (target == TARGET_X64) {
+            emit("  imulq $%d, %%rax, %%rax", size);
+        } else {
+            emit("  mov x2, #%d", size);
+            emit("  mul x0, x0, x2");
+        }
+    } else if (n) {
+        if (target == TARGET_X64) {
+            emit("  shlq $%d, %%rax", n);
+        } else {
+            emit("  lsl x0, x0, #%d", n);
+        }
+    }
+}
+
 void postfix(void) {
+    int start = ncode;
+    
     primary();
     
     while (1) {
         if (token == '[') {
+            struct operand base, index;
+            int mark, e;
+            int skind = ekind, stag = etag;
+            
+            rvalue();
+            base = simple_operand(start);
             push();
+            mark = ncode;
             token = gettoken();
             expression();
             if (token != ']') error("Expected ]");
             token = gettoken();
+            index = simple_operand(mark);
             
-            if (target == TARGET_X64) {
-                emit("  shlq $3, %%rax");
-                pop("%rdx");
-                emit("  addq %%rdx, %%rax");
-                emit("  movq (%%rax), %%rax");
-            } else {
-                emit("  lsl x0, x0, #3");
-                pop("x1");
-                emit("  add x0, x1, x0");
-                emit("  ldr x0, [x0]");
+            if (skind == EK_PTR || skind == EK_ROWS) {
+                /* Element of a struct array, or row of a 2-D array: its
+                 * address. The stride is a constant, and so is the whole
+                 * offset when the index is */
+                struct symbol *rsym = erows;
+                int stride = skind == EK_PTR ? structs[stag].size :
+                             type_size(rsym->type, rsym->tag, rsym->cols);
+                if (index.kind == OP_CONST && base.kind != OP_NONE) {
+                    ncode = start;
+                    sp += (target == TARGET_X64 ? 8 : 16);
+                    emit_operand_to(&base, target == TARGET_X64 ? "%rax" : "x0");
+                    emit_add_const(index.val * stride);
+                } else {
+                    emit_scale(stride);
+                    if (target == TARGET_X64) {
+                        pop("%rdx");
+                        emit("  addq %%rdx, %%rax");
+                    } else {
+                        pop("x1");
+                        emit("  add x0, x1, x0");
+                    }
+                }
+                lval = LV_NONE;
+                if (skind == EK_PTR) {
+                    ekind = EK_OBJ;
+                    etag = stag;
+                } else {
+                    ekind = rsym->type == STRUCTOBJ ? EK_PTR : EK_NONE;
+                    etag = rsym->tag;
+                }
+                start = -1;
+                continue;
             }
-        } else if (token == T_INC || token == T_DEC) {
-            int op = token;
-            token = gettoken();
             
-            if (target == TARGET_X64) {
-                emit("  movq %%rax, %%rdx");
-                emit("  movq (%%rax), %%rax");
-                emit("  %sq (%%rdx)", op == T_INC ? "inc" : "dec");
-            } else {
-                emit("  mov x1, x0");
-                emit("  ldr x0, [x0]");
-                emit("  ldr x2, [x1]");
-                emit("  %s x2, x2, #1", op == T_INC ? "add" : "sub");
-                emit("  str x2, [x1]");
-            }
-        } else if (token == '(') {
-            /* Function call */
-            struct symbol *sym = lookup(tokstr);
-            char fname[NAMESIZE];
-            strcpy(fname, tokstr);
-            int nargs = 0;
-            
-            token = gettoken();
+            if (index.kind == OP_CONST && base.kind == OP_NONE) {
+                /* Constant index into a computed address, such as a row:
+                 * a displacement on the access */
+                ncode = mark - 1;
+                sp += (target == TARGET_X64 ? 8 : 16);
+                lval = LV_MEM;
+                lvvn = -1;
+                lvinreg = 1;
+                lvbase = base;
+                lvdisp = index.val * 8;
+                lvwidth = 8;
+                ekind = EK_NONE;
+                start = -1;
+                continue;
+            }
             
-            /* Push arguments in reverse order */
-            if (token != ')') {
-                /* Count arguments first */
-                char *save_lptr = lptr;
-                int save_line = lineno;
-                int paren = 1;
-                nargs = 1;
-                while (paren > 0 && *lptr) {
-                    if (*lptr == '(') paren++;
-                    else if (*lptr == ')') paren--;
-                    else if (*lptr == ',' && paren == 1) nargs++;
-                    if (*lptr == '\n') lineno++;
-                    lptr++;
-                }
-                lptr = save_lptr;
-                lineno = save_line;
-                
-                /* Evaluate arguments */
-                int arg_count = 0;
-                while (token != ')' && token != T_EOF) {
-                    if (arg_count >= MAXARGS) {
-                        error("Too many function arguments");
-                        /* Skip remaining arguments */
-                        while (token != ')' && token != T_EOF) {
-                            token = gettoken();
-                        }
-                        break;
-                    }
-                    expression();
-                    push();
-                    arg_count++;
-                    if (token == ',') {
-                        token = gettoken();
-                    } else if (token != ')') {
-                        error("Expected , or )");
-                        break;
-                    }
-                }
-                
-                /* Pop arguments into registers */
+            e = -1;
+            if (base.kind != OP_NONE && index.kind != OP_NONE)
+                e = vn_find(&base, &index);
+            if (e >= 0) {
+                /* Address already computed in this block */
+                ncode = start;
+                sp += (target == TARGET_X64 ? 8 : 16);
+                lvinreg = 0;
+            } else {
                 if (target == TARGET_X64) {
-                    char *arg_regs[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-                    for (int i = arg_count - 1; i >= 0 && i < 6; i--) {
-                        pop(arg_regs[i]);
-                    }
+                    emit("  shlq $3, %%rax");
+                    pop("%rdx");
+                    emit("  addq %%rdx, %%rax");
                 } else {
-                    for (int i = arg_count - 1; i >= 0 && i < 8; i--) {
-                        char reg[16];
-                        snprintf(reg, sizeof(reg), "x%d", i);
-                        pop(reg);
-                    }
+                    emit("  lsl x0, x0, #3");
+                    pop("x1");
+                    emit("  add x0, x1, x0");
                 }
+                if (base.kind != OP_NONE && index.kind != OP_NONE)
+                    e = vn_add(&base, &index);
+                lvinreg = 1;
             }
+            lval = LV_MEM;
+            lvvn = e;
+            lvbase = base;
+            lvdisp = 0;
+            lvwidth = 8;
+            ekind = EK_NONE;
+            start = -1;
+        } else if (token == '.' || token == T_ARROW) {
+            struct symbol *osym = NULL;
+            struct field *f;
+            int tag = etag, disp = 0;
             
-            if (token != ')') error("Expected )");
-            token = gettoken();
+            if (token == '.') {
+                struct operand obj = simple_operand(start);
+                if (ekind != EK_OBJ) error("Expected struct before .");
+                if (obj.kind == OP_ADDR && !aligned_slot(obj.sym)) {
+                    /* Named struct: address it directly */
+                    ncode = start;
+                    osym = obj.sym;
+                }
+            } else {
+                if (ekind != EK_PTR) error("Expected struct pointer before ->");
+                rvalue();
+            }
             
-            /* Call function */
-            if (target == TARGET_X64) {
-                emit("  call %s", fname);
+            /* a.b.c folds into one displacement */
+            while (1) {
+                token = gettoken();
+                if (token != T_IDENT) error("Expected field name");
+                f = lookup_field(tag, tokstr);
+                disp += f->offset;
+                token = gettoken();
+                if (f->type != STRUCTOBJ || f->count || token != '.') break;
+                tag = f->tag;
+            }
+            
+            ekind = EK_NONE;
+            etag = f->tag;
+            if (f->type == STRUCTOBJ || f->count) {
+                /* Nested struct or array: its address */
+                if (osym) emit_addr_var(osym);
+                emit_add_const(disp);
+                if (f->type == STRUCTOBJ) ekind = f->count ? EK_PTR : EK_OBJ;
+                lval = LV_NONE;
             } else {
-                emit("  bl %s", fname);
+                if (f->type == STRUCTPTR) ekind = EK_PTR;
+                lval = osym ? LV_FIELD : LV_MEM;
+                lvsym = osym;
+                lvdisp = disp;
+                lvwidth = f->type == 1 ? 1 : 8;
+                lvvn = -1;
+                lvinreg = 1;
+                lvbase.kind = OP_NONE;
             }
+            lastop_at = -1;
+            start = -1;
+        } else if (token == T_INC || token == T_DEC) {
+            int op = token;
+            token = gettoken();
+            incdec(op, 1);
         } else {
             break;
         }
     }
 }
 
-void primary(void) {
-    switch (token) {
-        case T_NUMBER:
+/* Pop everything pushed since sp was base */
+void release_stack(int base) {
+    if (sp != base) {
+        if (target == TARGET_X64) {
+            emit("  addq $%d, %%rsp", base - sp);
+        } else {
+            emit("  add sp, sp, #%d", base - sp);
+        }
+        sp = base;
+    }
+}
+
+/* The call instruction itself; arguments are already in place */
+void emit_call(char *fname) {
+    unsafe_ops++;
+    vn_clear();
+    if (target == TARGET_X64) {
+        emit("  call %s", fname);
+    } else {
+        emit("  bl %s", fname);
+    }
+}
+
+/* Call with register arguments already loaded, padding the stack to
+ * 16 bytes around it if spills left it misaligned */
+void emit_aligned_call(char *fname) {
+    int pad = (frame_sp - sp) % 16 ? 8 : 0;
+    if (pad) emit("  subq $8, %%rsp");
+    emit_call(fname);
+    if (pad) emit("  addq $8, %%rsp");
+}
+
+/* Argument of a call being lowered: simple ones are still unloaded,
+ * complex ones were spilled with sp at spill */
+void load_arg(struct operand *op, int spill, char *reg) {
+    if (!spill) {
+        emit_operand_to(op, reg);
+    } else if (target == TARGET_X64) {
+        emit("  movq %d(%%rsp), %s", spill - sp, reg);
+    } else {
+        emit("  ldr %s, [sp, #%d]", reg, spill - sp);
+    }
+}
+
+/* Copy or fill n bytes at the address in %rdx/x1, from %rsi/x2 or with
+ * the byte pattern in %rcx/x3, widest moves first */
+void emit_block_moves(int n, int copy) {
+    static char *x64op[] = {"movq", "movl", "movw", "movb"};
+    static char *x64reg[] = {"%rcx", "%ecx", "%cx", "%cl"};
+    static char *armsuf[] = {"", "", "h", "b"};
+    static char *armreg[] = {"x3", "w3", "w3", "w3"};
+    int off = 0, w, k;
+    
+    for (k = 0, w = 8; w > 0; k++, w /= 2) {
+        while (n - off >= w) {
+            if (target == TARGET_X64) {
+                if (copy) emit("  %s %d(%%rsi), %s", x64op[k], off, x64reg[k]);
+                emit("  %s %s, %d(%%rdx)", x64op[k], x64reg[k], off);
+            } else {
+                if (copy) emit("  ldr%s %s, [x2, #%d]", armsuf[k], armreg[k], off);
+                emit("  str%s %s, [x1, #%d]", armsuf[k], armreg[k], off);
+            }
+            off += w;
+        }
+    }
+}
+
+/*
+ * printf with a literal format is split at compile time: literal text
+ * becomes one write() per run, and each conversion a direct call to the
+ * runtime formatter (printn, printh, putchar, fputs). Formats with
+ * anything other than %d %x %c %s %% are left to printf.
+ */
+int specialize_printf(struct operand *args, int *spill, int nargs) {
+    struct strlit *lit = NULL;
+    struct operand op[3];
+    char *f;
+    int i, k, run, len, conv = 0;
+    
+    for (i = 0; i < nstrlits; i++) {
+        if (strlits[i].label == args[0].val) lit = &strlits[i];
+    }
+    if (!lit) return 0;
+    f = strpool + lit->offset;
+    len = lit->len;
+    for (i = 0; i < len; i++) {
+        if (f[i] != '%') continue;
+        if (++i >= len || !strchr("dxcs%", f[i])) return 0;
+        if (f[i] != '%') conv++;
+    }
+    if (conv != nargs - 1) return 0;
+    lit->refs--;
+    
+    k = 1;
+    for (i = 0; i < len; i = run) {
+        if (f[i] != '%' || f[i + 1] == '%') {
+            /* Literal run, with %% standing for one % */
+            run = i + 1;
+            if (f[i] == '%') {
+                i++;
+                run++;
+            }
+            while (run < len && f[run] != '%') run++;
+            op[0].kind = OP_CONST;
+            op[0].val = 1;
+            op[1].kind = OP_STR;
+            op[1].val = add_string(f + i, run - i);
+            op[2].kind = OP_CONST;
+            op[2].val = run - i;
+            emit_operand_to(&op[0], argreg(0));
+            emit_operand_to(&op[1], argreg(1));
+            emit_operand_to(&op[2], argreg(2));
+            emit_aligned_call("write");
+            continue;
+        }
+        load_arg(&args[k], spill[k], argreg(0));
+        k++;
+        switch (f[i + 1]) {
+            case 'd': emit_aligned_call("printn"); break;
+            case 'x': emit_aligned_call("printh"); break;
+            case 'c': emit_aligned_call("putchar"); break;
+            case 's':
+                op[0].kind = OP_CONST;
+                op[0].val = 1;
+                emit_operand_to(&op[0], argreg(1));
+                emit_aligned_call("fputs");
+                break;
+        }
+        run = i + 2;
+    }
+    emit_load_const(0);
+    return 1;
+}
+
+/*
+ * Runtime helpers the compiler knows the meaning of. With constant
+ * arguments strlen/abs/min/max fold to a constant; abs/min/max otherwise
+ * become a compare and conditional move, memset/memcpy of a small
+ * constant size become direct stores, and printf with a literal format
+ * is specialized. Returns 0 to make a real call.
+ */
+int builtin(char *fname, struct operand *args, int *spill, int nargs, int base) {
+    struct function *func = lookup_func(fname);
+    int c[3], i, isconst = 1;
+    
+    if (!use_builtins || (func && func->defined)) return 0;
+    for (i = 0; i < nargs && i < 3; i++) {
+        c[i] = args[i].val;
+        if (args[i].kind != OP_CONST) isconst = 0;
+    }
+    
+    if (!strcmp(fname, "strlen") && nargs == 1 && args[0].kind == OP_STR) {
+        for (i = 0; i < nstrlits; i++) {
+            if (strlits[i].label == args[0].val) {
+                strlits[i].refs--;
+                emit_load_const(strlen(strpool + strlits[i].offset));
+                return 1;
+            }
+        }
+        return 0;
+    }
+    
+    if (!strcmp(fname, "abs") && nargs == 1) {
+        if (isconst) {
+            emit_load_const(c[0] < 0 ? -c[0] : c[0]);
+            return 1;
+        }
+        load_arg(&args[0], spill[0], target == TARGET_X64 ? "%rax" : "x0");
+        if (target == TARGET_X64) {
+            emit("  movq %%rax, %%rdx");
+            emit("  negq %%rax");
+            emit("  cmovlq %%rdx, %%rax");
+        } else {
+            emit("  cmp x0, #0");
+            emit("  cneg x0, x0, lt");
+        }
+    } else if ((!strcmp(fname, "min") || !strcmp(fname, "max")) && nargs == 2) {
+        int ismin = fname[1] == 'i';
+        if (isconst) {
+            emit_load_const(ismin ? (c[0] < c[1] ? c[0] : c[1])
+                                  : (c[0] > c[1] ? c[0] : c[1]));
+            return 1;
+        }
+        if (target == TARGET_X64) {
+            load_arg(&args[0], spill[0], "%rdx");
+            load_arg(&args[1], spill[1], "%rax");
+            emit("  cmpq %%rax, %%rdx");
+            emit("  cmov%sq %%rdx, %%rax", ismin ? "l" : "g");
+        } else {
+            load_arg(&args[0], spill[0], "x1");
+            load_arg(&args[1], spill[1], "x0");
+            emit("  cmp x1, x0");
+            emit("  csel x0, x1, x0, %s", ismin ? "lt" : "gt");
+        }
+    } else if (!strcmp(fname, "printf") && nargs >= 1 && args[0].kind == OP_STR) {
+        if (!specialize_printf(args, spill, nargs)) return 0;
+    } else if ((!strcmp(fname, "memset") || !strcmp(fname, "memcpy")) && nargs == 3 &&
+               args[2].kind == OP_CONST && c[2] >= 0 && c[2] <= 64) {
+        int copy = fname[3] == 'c';
+        if (!copy) {
+            unsigned long long pat;
+            if (args[1].kind != OP_CONST) return 0;
+            pat = (c[1] & 0xff) * 0x0101010101010101ULL;
             if (target == TARGET_X64) {
-                emit("  movq $%d, %%rax", tokval);
+                if (pat) emit("  movabsq $0x%llx, %%rcx", pat);
+                else emit("  xorl %%ecx, %%ecx");
             } else {
-                emit("  mov x0, #%d", tokval);
+                if (pat) emit("  ldr x3, =0x%llx", pat);
+                else emit("  mov x3, xzr");
             }
+        }
+        if (target == TARGET_X64) {
+            load_arg(&args[0], spill[0], "%rdx");
+            if (copy) load_arg(&args[1], spill[1], "%rsi");
+        } else {
+            load_arg(&args[0], spill[0], "x1");
+            if (copy) load_arg(&args[1], spill[1], "x2");
+        }
+        emit_block_moves(c[2], copy);
+        if (target == TARGET_X64) {
+            emit("  movq %%rdx, %%rax");
+        } else {
+            emit("  mov x0, x1");
+        }
+        unsafe_ops++;
+        vn_store_mem(&args[0]);
+    } else {
+        return 0;
+    }
+    
+    release_stack(base);
+    return 1;
+}
+
+/*
+ * Compiler intrinsics. These have no library fallback and are expanded
+ * even with -fno-builtin. Values are the full 64-bit int; the memory
+ * order of the __atomic ones is accepted and always treated as seq_cst.
+ * On x64 clz and ctz use bsr and bsf unless -mlzcnt or -mbmi allow
+ * lzcnt and tzcnt: a CPU without those runs them as bsr and bsf and
+ * gets a wrong answer. -mbaseline avoids popcnt too, which does fault.
+ * All give 64 for a zero argument, as the constant folding does.
+ */
+int intrinsic(char *fname, struct operand *args, int *spill, int nargs, int base) {
+    int rotl = !strcmp(fname, "__builtin_rotateleft64");
+    int rotr = !strcmp(fname, "__builtin_rotateright64");
+    char *acc = target == TARGET_X64 ? "%rax" : "x0";
+    int n = 0, l1, l2;
+    
+    if (strncmp(fname, "__builtin_", 10) && strncmp(fname, "__atomic_", 9) &&
+        strcmp(fname, "__sync_synchronize")) return 0;
+    
+    if (!strncmp(fname, "__builtin_popcount", 18) ||
+        !strncmp(fname, "__builtin_ctz", 13) ||
+        !strncmp(fname, "__builtin_clz", 13)) {
+        char *op = fname + 10;
+        if (nargs != 1) error("Expected one argument");
+        if (args[0].kind == OP_CONST) {
+            unsigned long long v = (long long)args[0].val;
+            if (op[0] == 'p') {
+                for (; v; v &= v - 1) n++;
+            } else if (op[1] == 't') {
+                while (n < 64 && !(v >> n & 1)) n++;
+            } else {
+                while (n < 64 && !(v << n >> 63)) n++;
+            }
+            emit_load_const(n);
+            return 1;
+        }
+        load_arg(&args[0], spill[0], acc);
+        if (target == TARGET_X64) {
+            if (op[0] == 'p' && use_popcnt) {
+                emit("  popcntq %%rax, %%rax");
+            } else if (op[0] == 'p') {
+                emit("  movq %%rax, %%rdx");
+                emit("  shrq $1, %%rdx");
+                emit("  movabsq $0x5555555555555555, %%rcx");
+                emit("  andq %%rcx, %%rdx");
+                emit("  subq %%rdx, %%rax");
+                emit("  movabsq $0x3333333333333333, %%rcx");
+                emit("  movq %%rax, %%rdx");
+                emit("  andq %%rcx, %%rax");
+                emit("  shrq $2, %%rdx");
+                emit("  andq %%rcx, %%rdx");
+                emit("  addq %%rdx, %%rax");
+                emit("  movq %%rax, %%rdx");
+                emit("  shrq $4, %%rdx");
+                emit("  addq %%rdx, %%rax");
+                emit("  movabsq $0x0f0f0f0f0f0f0f0f, %%rcx");
+                emit("  andq %%rcx, %%rax");
+                emit("  movabsq $0x0101010101010101, %%rcx");
+                emit("  imulq %%rcx, %%rax");
+                emit("  shrq $56, %%rax");
+            } else if (op[1] == 't' && use_tzcnt) {
+                emit("  tzcntq %%rax, %%rax");
+            } else if (op[1] == 't') {
+                emit("  movq $64, %%rdx");
+                emit("  bsfq %%rax, %%rax");
+                emit("  cmovzq %%rdx, %%rax");
+            } else if (use_lzcnt) {
+                emit("  lzcntq %%rax, %%rax");
+            } else {
+                emit("  movq $127, %%rdx");     /* 127 ^ 63 = 64 */
+                emit("  bsrq %%rax, %%rax");
+                emit("  cmovzq %%rdx, %%rax");
+                emit("  xorq $63, %%rax");
+            }
+        } else {
+            if (op[0] == 'p') {
+                emit("  fmov d0, x0");
+                emit("  cnt v0.8b, v0.8b");
+                emit("  addv b0, v0.8b");
+                emit("  fmov x0, d0");
+            } else {
+                if (op[1] == 't') emit("  rbit x0, x0");
+                emit("  clz x0, x0");
+            }
+        }
+    } else if (!strcmp(fname, "__builtin_bswap64")) {
+        if (nargs != 1) error("Expected one argument");
+        load_arg(&args[0], spill[0], acc);
+        if (target == TARGET_X64) {
+            emit("  bswapq %%rax");
+        } else {
+            emit("  rev x0, x0");
+        }
+    } else if (rotl || rotr) {
+        if (nargs != 2) error("Expected two arguments");
+        load_arg(&args[0], spill[0], acc);
+        if (args[1].kind == OP_CONST) {
+            n = args[1].val & 63;
+            if (target == TARGET_X64) {
+                emit("  %sq $%d, %%rax", rotl ? "rol" : "ror", n);
+            } else {
+                emit("  ror x0, x0, #%d", rotl ? (64 - n) & 63 : n);
+            }
+        } else if (target == TARGET_X64) {
+            load_arg(&args[1], spill[1], "%rcx");
+            emit("  %sq %%cl, %%rax", rotl ? "rol" : "ror");
+        } else {
+            load_arg(&args[1], spill[1], "x1");
+            if (rotl) emit("  neg x1, x1");
+            emit("  ror x0, x0, x1");
+        }
+    } else if (!strcmp(fname, "__atomic_fetch_add")) {
+        if (nargs != 3) error("Expected three arguments");
+        if (target == TARGET_X64) {
+            load_arg(&args[0], spill[0], "%rdx");
+            load_arg(&args[1], spill[1], "%rax");
+            emit("  lock xaddq %%rax, (%%rdx)");
+        } else {
+            load_arg(&args[0], spill[0], "x1");
+            load_arg(&args[1], spill[1], "x2");
+            l1 = lab++;
+            emit_label(l1);
+            emit("  ldaxr x0, [x1]");
+            emit("  add x3, x0, x2");
+            emit("  stlxr w4, x3, [x1]");
+            emit("  cbnz w4, L%d", l1);
+        }
+        unsafe_ops++;
+        vn_clear();
+    } else if (!strcmp(fname, "__atomic_compare_exchange") ||
+               !strcmp(fname, "__atomic_compare_exchange_n")) {
+        /* (ptr, &expected, desired, weak, success, failure); the generic
+         * form passes desired by address. Returns 1 if *ptr was replaced,
+         * else 0 with the current value written to expected. */
+        int byaddr = fname[25] == '\0';
+        if (nargs != 6) error("Expected six arguments");
+        if (target == TARGET_X64) {
+            load_arg(&args[0], spill[0], "%rdx");
+            load_arg(&args[1], spill[1], "%rsi");
+            load_arg(&args[2], spill[2], "%rcx");
+            if (byaddr) emit("  movq (%%rcx), %%rcx");
+            emit("  movq (%%rsi), %%rax");
+            emit("  lock cmpxchgq %%rcx, (%%rdx)");
+            emit("  movq %%rax, (%%rsi)");
+            emit("  sete %%al");
+            emit("  movzbq %%al, %%rax");
+        } else {
+            load_arg(&args[0], spill[0], "x1");
+            load_arg(&args[1], spill[1], "x2");
+            load_arg(&args[2], spill[2], "x3");
+            if (byaddr) emit("  ldr x3, [x3]");
+            emit("  ldr x4, [x2]");
+            l1 = lab++;
+            l2 = lab++;
+            emit_label(l1);
+            emit("  ldaxr x0, [x1]");
+            emit("  cmp x0, x4");
+            emit("  b.ne L%d", l2);
+            emit("  stlxr w5, x3, [x1]");
+            emit("  cbnz w5, L%d", l1);
+            emit_label(l2);
+            emit("  str x0, [x2]");
+            emit("  cset x0, eq");
+        }
+        unsafe_ops++;
+        vn_clear();
+    } else if (!strcmp(fname, "__atomic_thread_fence") ||
+               !strcmp(fname, "__sync_synchronize")) {
+        if (target == TARGET_X64) {
+            emit("  mfence");
+        } else {
+            emit("  dmb ish");
+        }
+        unsafe_ops++;
+        vn_clear();
+    } else {
+        return 0;
+    }
+    
+    release_stack(base);
+    return 1;
+}
+
+/*
+ * Function call. Arguments are evaluated left to right. Simple ones
+ * (constants, variables, addresses) are loaded straight into their
+ * register just before the call; complex ones are spilled, except the
+ * last one when it goes in a register and nothing else needs the
+ * accumulator. Arguments past the register count are copied to an
+ * outgoing area at the bottom of the stack, padded so the stack is
+ * 16-byte aligned at the call.
+ */
+/*
+ * -whole: expand a call to an inline candidate in place. The arguments
+ * are stored to fresh slots, which are then named after its parameters,
+ * and the body is parsed again from its text with only those slots
+ * visible among the locals.
+ */
+int inline_call(char *fname) {
+    struct inlinefn *fi = lookup_inline(fname);
+    struct symbol *sym;
+    int first = nlocals, floor = lookup_floor, scope = scope_first, live_sp = lsp;
+    int n = 0, i;
+    struct tokstream *save_ts;
+    char tmp[8];
+    int resume;
+    
+    if (!fi || inline_depth >= 4 || !strcmp(fname, curfunc)) return 0;
+    if (!inline_resolvable(fi)) return 0;
+    
+    scope_first = nlocals;
+    while (token != ')' && token != T_EOF) {
+        if (n >= fi->nparams) error("Too many function arguments");
+        expression();
+        snprintf(tmp, sizeof(tmp), "#%d", n);
+        sym = add_symbol(tmp, fi->ptypes[n], 0, -1, 0);
+        emit_store_var(sym);
+        n++;
+        if (token == ',') {
             token = gettoken();
+        } else if (token != ')') {
+            error("Expected , or )");
+        }
+    }
+    if (token != ')') error("Expected )");
+    if (n != fi->nparams) error("Wrong number of arguments");
+    for (i = 0; i < n; i++) locals[first + i]->name = fi->params[i];
+    
+    /* Parse the body from its tokens, then resume after the ) */
+    save_ts = ts;
+    resume = tokpos;
+    ts = &fi->body;
+    tokpos = 0;
+    lookup_floor = first;
+    inline_depth++;
+    token = gettoken();
+    expression();
+    if (token != ';') error("Unexpected token in inlined function");
+    inline_depth--;
+    lookup_floor = floor;
+    ts = save_ts;
+    token_seek(resume);
+    
+    /* The parameter slots die here, as at the end of a block */
+    scope_first = scope;
+    nlocals = first;
+    lsp = live_sp;
+    vn_clear();
+    lastop_at = -1;
+    return 1;
+}
+
+void call(char *fname) {
+    struct operand args[MAXARGS];
+    int spill[MAXARGS];     /* sp after the spill, 0 if not spilled */
+    int inreg[MAXARGS];
+    int nargs = 0, lastc = -1;
+    int base = sp, nstack, area, i, mark, d;
+    char *acc = target == TARGET_X64 ? "%rax" : "x0";
+    
+    token = gettoken();
+    if (vec_builtin(fname)) return;
+    if (whole && inline_call(fname)) return;
+    while (token != ')' && token != T_EOF) {
+        if (nargs >= MAXARGS) error("Too many function arguments");
+        mark = ncode;
+        expression();
+        args[nargs] = simple_operand(mark);
+        spill[nargs] = 0;
+        inreg[nargs] = 0;
+        if (args[nargs].kind != OP_NONE) {
+            ncode = mark;   /* reloaded into place below */
+        } else {
+            push();
+            spill[nargs] = sp;
+            lastc = nargs;
+        }
+        nargs++;
+        if (token == ',') {
+            token = gettoken();
+        } else if (token != ')') {
+            error("Expected , or )");
             break;
-            
-        case T_CHARLIT:
+        }
+    }
+    if (token != ')') error("Expected )");
+    token = gettoken();
+    
+    if (intrinsic(fname, args, spill, nargs, base)) return;
+    if (builtin(fname, args, spill, nargs, base)) return;
+    
+    nstack = nargs > nregargs() ? nargs - nregargs() : 0;
+    
+    /* The last complex register argument need not round-trip the stack */
+    if (lastc >= 0 && lastc < nregargs() && nstack == 0 &&
+        spill[lastc] == sp) {
+        ncode--;
+        sp += (target == TARGET_X64 ? 8 : 16);
+        spill[lastc] = 0;
+        inreg[lastc] = 1;
+        if (target == TARGET_X64) {
+            emit("  movq %%rax, %s", argreg(lastc));
+        } else if (lastc != 0) {
+            emit("  mov %s, x0", argreg(lastc));
+        }
+    }
+    
+    /* Outgoing stack arguments */
+    area = nstack * 8;
+    while ((frame_sp - sp + area) % 16) area += 8;
+    if (area) {
+        if (target == TARGET_X64) {
+            emit("  subq $%d, %%rsp", area);
+        } else {
+            emit("  sub sp, sp, #%d", area);
+        }
+        sp -= area;
+    }
+    for (i = nregargs(); i < nargs; i++) {
+        d = (i - nregargs()) * 8;
+        if (spill[i]) {
             if (target == TARGET_X64) {
-                emit("  movq $%d, %%rax", tokval);
+                emit("  movq %d(%%rsp), %%rax", spill[i] - sp);
             } else {
-                emit("  mov x0, #%d", tokval);
+                emit("  ldr x0, [sp, #%d]", spill[i] - sp);
             }
+        } else {
+            emit_operand_to(&args[i], acc);
+        }
+        if (target == TARGET_X64) {
+            emit("  movq %%rax, %d(%%rsp)", d);
+        } else {
+            emit("  str x0, [sp, #%d]", d);
+        }
+    }
+    
+    /* Register arguments: spilled ones first, the accumulator last */
+    for (i = 0; i < nargs && i < nregargs(); i++) {
+        if (!spill[i]) continue;
+        if (target == TARGET_X64) {
+            emit("  movq %d(%%rsp), %s", spill[i] - sp, argreg(i));
+        } else {
+            emit("  ldr %s, [sp, #%d]", argreg(i), spill[i] - sp);
+        }
+    }
+    for (i = nargs < nregargs() ? nargs - 1 : nregargs() - 1; i >= 0; i--) {
+        if (!spill[i] && !inreg[i]) emit_operand_to(&args[i], argreg(i));
+    }
+    
+    emit_call(fname);
+    
+    /* Drop spills and the outgoing area */
+    release_stack(base);
+    lastop_at = -1;
+}
+
+void primary(void) {
+    lval = LV_NONE;
+    ekind = EK_NONE;
+    
+    switch (token) {
+        case T_NUMBER:
+        case T_CHARLIT:
+            emit_load_const(tokval);
             token = gettoken();
             break;
             
         case T_STRING:
             {
-                int slab = lab++;
-                emit(".data");
-                emit("S%d:", slab);
-                emit("  .asciz \"%s\"", tokstr);
-                emit(".text");
+                int slab = add_string(tokstr, toklen);
                 
+                lastop_at = ncode;
                 if (target == TARGET_X64) {
                     emit("  movq $S%d, %%rax", slab);
                 } else {
                     emit("  adrp x0, S%d", slab);
                     emit("  add x0, x0, :lo12:S%d", slab);
                 }
+                lastop_end = ncode;
+                lastop.kind = OP_STR;
+                lastop.val = slab;
                 token = gettoken();
             }
             break;
             
         case T_IDENT:
             {
-                char name[NAMESIZE];
-                strcpy(name, tokstr);
+                char *name = arena_strdup(&func_arena, tokstr);
                 struct symbol *sym = lookup(name);
                 
                 token = gettoken();
                 
                 if (token == '(') {
-                    /* Function call - handled in postfix */
-                    strcpy(tokstr, name);
-                    postfix();
+                    call(name);
+                    ekind = EK_NONE;
                     return;
                 }
                 
                 if (!sym) {
                     /* Might be a function */
                     struct function *func = lookup_func(name);
-                    if (func) {
+                    int i;
+                    for (i = 0; i < 6 && strcmp(name, atomic_orders[i]); i++)
+                        ;
+                    if (i < 6) {
+                        emit_load_const(i);
+                    } else if (func) {
                         if (target == TARGET_X64) {
                             emit("  movq $%s, %%rax", name);
                         } else {
@@ -1596,33 +5045,20 @@ void primary(void) {
                     } else {
                         error("Undefined variable");
                     }
-                } else if (sym->isarray) {
-                    if (sym->isparam || sym->offset < 0) {
-                        if (target == TARGET_X64) {
-                            emit("  leaq %d(%%rbp), %%rax", sym->offset);
-                        } else {
-                            emit("  add x0, x29, #%d", sym->offset);
-                        }
-                    } else {
-                        if (target == TARGET_X64) {
-                            emit("  movq $%s, %%rax", sym->name);
-                        } else {
-                            emit("  adrp x0, %s", sym->name);
-                            emit("  add x0, x0, :lo12:%s", sym->name);
-                        }
+                } else if (sym->isarray || sym->type == STRUCTOBJ) {
+                    emit_addr_var(sym);
+                    if (sym->type == STRUCTOBJ) ekind = sym->isarray ? EK_PTR : EK_OBJ;
+                    if (sym->cols) {
+                        ekind = EK_ROWS;
+                        erows = sym;
                     }
                 } else {
-                    if (sym->isparam || sym->offset < 0) {
-                        emit_load_local(sym->offset);
-                    } else {
-                        if (target == TARGET_X64) {
-                            emit("  movq %s(%%rip), %%rax", sym->name);
-                        } else {
-                            emit("  adrp x0, %s", sym->name);
-                            emit("  ldr x0, [x0, :lo12:%s]", sym->name);
-                        }
-                    }
+                    /* Loaded on use, or stored to */
+                    lval = LV_VAR;
+                    lvsym = sym;
+                    if (sym->type == STRUCTPTR) ekind = EK_PTR;
                 }
+                if (sym) etag = sym->tag;
             }
             break;
             
@@ -1638,39 +5074,343 @@ void primary(void) {
     }
 }
 
-int main(int argc, char **argv) {
+/* -whole: scalar global that is never stored to and whose address is
+ * never taken, so every load of it is its initial value */
+struct symbol *unwritten_global(char *name) {
+    struct symbol *sym = find_global(name);
+    if (!sym || sym->isarray || sym->type > 3 || sym->written || sym->addrtaken) return NULL;
+    return sym;
+}
+
+/* Mark the defined functions a body names: calls and addresses taken */
+void mark_refs(struct function *f) {
+    char *p = wholetext + f->text_start, *end = wholetext + f->text_end;
+    char *word, c;
+    struct function *g;
+    
+    while (p < end) {
+        if ((*p == '#' || (*p == '/' && p[1] == '/')) && p[-1] == '\n') {
+            /* an -annotate comment quotes source, not code */
+            while (p < end && *p != '\n') p++;
+        } else if (isalpha(*p) || *p == '_') {
+            word = p;
+            while (p < end && (isalnum(*p) || *p == '_')) p++;
+            c = *p;             /* the word is looked up in place */
+            *p = '\0';
+            g = lookup_func(word);
+            *p = c;
+            if (g && g->defined && !g->live) g->live = 1;
+        } else if (isdigit(*p)) {
+            while (p < end && isalnum(*p)) p++;
+        } else {
+            p++;
+        }
+    }
+}
+
+/*
+ * -whole: write out the functions main can reach. Loads of scalar
+ * globals nothing writes become constants. An asm statement could name
+ * anything, so with one present every function and load is kept.
+ */
+void whole_output(void) {
+    struct function *f, *m = lookup_func("main");
+    struct symbol *sym;
+    char *name, *reg, *next;
+    char *p, *nl;
+    int i, changed = 1;
+    
+    for (i = 0; i < nfuncs; i++) {
+        functions[i]->live = functions[i]->defined && (whole_asm || !m);
+    }
+    if (m && m->defined) m->live = 1;
+    while (changed) {
+        changed = 0;
+        for (i = 0; i < nfuncs; i++) {
+            f = functions[i];
+            if (f->live != 1) continue;
+            f->live = 2;
+            mark_refs(f);
+            changed = 1;
+        }
+    }
+    
+    emit(".text");
+    for (i = 0; i < nfuncs; i++) {
+        f = functions[i];
+        if (!f->live) continue;
+        p = wholetext + f->text_start;
+        while (p < wholetext + f->text_end) {
+            nl = strchr(p, '\n');
+            *nl = '\0';
+            sym = NULL;
+            /* name and reg cannot be longer than the line */
+            arena_reset(&func_arena);
+            name = arena_alloc(&func_arena, nl - p + 1);
+            reg = arena_alloc(&func_arena, nl - p + 1);
+            if (whole_asm) {
+                /* keep the line */
+            } else if (target == TARGET_X64) {
+                if (sscanf(p, "  movq %[A-Za-z0-9_](%%rip), %s", name, reg) == 2) {
+                    sym = unwritten_global(name);
+                }
+            } else if (sscanf(p, "  adrp %[a-z0-9], %[A-Za-z0-9_]", reg, name) == 2) {
+                next = arena_printf(&func_arena, "  ldr %s, [%s, :lo12:%s]", reg, reg, name);
+                if (!strncmp(nl + 1, next, strlen(next)) && nl[1 + strlen(next)] == '\n') {
+                    sym = unwritten_global(name);
+                }
+            }
+            if (!sym) {
+                out_bytes += printf("%s\n", p);
+            } else if (target == TARGET_X64) {
+                out_bytes += printf("  movq $%d, %s\n", sym->value, reg);
+            } else {
+                out_bytes += printf("  mov %s, #%d\n", reg, sym->value);
+                nl = strchr(nl + 1, '\n');     /* and the ldr */
+            }
+            p = nl + 1;
+        }
+    }
+}
+
+/* -annotate: read the unit into srctext, one string per line */
+void load_source(char *path) {
+    FILE *f = fopen(path, "r");
+    int n, i, cap = 0;
+    long size;
+    
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    srctext = arena_alloc(&unit_arena, size + 1);
+    n = fread(srctext, 1, size, f);
+    fclose(f);
+    srctext[n] = '\0';
+    srcoff = NULL;
+    nsrclines = 0;
+    for (i = 0; i < n; i = i + 1) {
+        if (i == 0 || srctext[i - 1] == '\0') {
+            GROW(&unit_arena, srcoff, nsrclines, cap);
+            srcoff[nsrclines++] = i;
+        }
+        if (srctext[i] == '\n' || srctext[i] == '\r') srctext[i] = '\0';
+    }
+    /* flush_code counts lines 0 to nsrclines + 1 */
+    lineinsns = arena_alloc(&unit_arena, (nsrclines + 2) * sizeof(int));
+    memset(lineinsns, 0, (nsrclines + 2) * sizeof(int));
+}
+
+/* -annotate: close the output with the instructions per function and
+ * the costliest source lines */
+void annotate_summary(void) {
+    char *cmt = target == TARGET_X64 ? "#" : "//";
+    char *where;
     int i;
     
+    emit("");
+    emit("%s instructions per function", cmt);
+    for (i = 0; i < nfuncs; i++) {
+        if (functions[i]->defined) emit("%s   %-24s %6d", cmt, functions[i]->name, functions[i]->insns);
+    }
+    emit("%s costliest source lines", cmt);
+    for (i = 0; i < nhotlines; i++) {
+        where = arena_printf(&func_arena, "%s:%d (%s)", hotlines[i].file,
+                             hotlines[i].line, hotlines[i].func);
+        emit("%s   %-24s %6d", cmt, where, hotlines[i].insns);
+    }
+}
+
+/*
+ * -stats: report to stderr where the time went and how full the tables
+ * got, as text or, with -stats=json, as one JSON object. Phase times are
+ * exclusive and add up to the total.
+ */
+void print_stats(char **units, int nunits) {
+    char *counter[] = {"tokens", "lookups", "lookup_probes", "longest_probe",
+                       "symbols", "labels", "instructions", "output_bytes"};
+    long value[] = {stat_tokens, stat_lookups, stat_probes, stat_maxprobe,
+                    stat_symbols, lab - 1, stat_insns, out_bytes};
+    char *table[] = {"globals", "locals", "functions", "structs", "fields",
+                     "strings", "string_pool", "code_lines", "loop_nesting",
+                     "inline_candidates", "whole_text", "profile_counters"};
+    long used[] = {nglobals, peak_locals, nfuncs, nstructs, nfields,
+                   nstrlits, strptr, peak_code, peak_loops,
+                   ninlines, wholelen, nprof};
+    long capacity[] = {maxglobals, peak_maxlocals, maxfuncs, maxstructs, maxfields,
+                       maxstrlits, maxstring, peak_maxcode, maxwhile,
+                       maxinlines, maxwhole, maxprof};
+    int ncounters = sizeof(counter) / sizeof(counter[0]);
+    int ntables = sizeof(table) / sizeof(table[0]);
+    double total = 0;
+    int i, n = 0;
+    
+    phase_enter(PH_PARSE);      /* charge the time up to now */
+    for (i = 0; i < NPHASES; i++) total += stat_time[i];
+    
+    if (stats == 2) {
+        fprintf(stderr, "{\n  \"units\": [");
+        for (i = 0; i < nunits; i++) {
+            fprintf(stderr, "%s\"%s\"", i ? ", " : "", units[i]);
+        }
+        fprintf(stderr, "],\n  \"seconds\": {");
+        for (i = 0; i < NPHASES; i++) {
+            fprintf(stderr, "\"%s\": %.6f, ", phase_names[i], stat_time[i]);
+        }
+        fprintf(stderr, "\"total\": %.6f},\n  \"counters\": {", total);
+        for (i = 0; i < ncounters; i++) {
+            fprintf(stderr, "%s\"%s\": %ld", i ? ", " : "", counter[i], value[i]);
+        }
+        fprintf(stderr, "},\n  \"tables\": {");
+        for (i = 0; i < ntables; i++) {
+            fprintf(stderr, "%s\n    \"%s\": {\"used\": %ld, \"capacity\": %ld}",
+                    i ? "," : "", table[i], used[i], capacity[i]);
+        }
+        fprintf(stderr, "\n  },\n  \"instructions\": {");
+        for (i = 0; i < nfuncs; i++) {
+            if (!functions[i]->defined) continue;
+            fprintf(stderr, "%s\"%s\": %d", n++ ? ", " : "", functions[i]->name,
+                    functions[i]->insns);
+        }
+        fprintf(stderr, "}\n}\n");
+        return;
+    }
+    
+    fprintf(stderr, "%-20s %12s\n", "phase", "seconds");
+    for (i = 0; i < NPHASES; i++) {
+        fprintf(stderr, "  %-18s %12.6f\n", phase_names[i], stat_time[i]);
+    }
+    fprintf(stderr, "  %-18s %12.6f\n", "total", total);
+    fprintf(stderr, "%-20s %12s\n", "counter", "value");
+    for (i = 0; i < ncounters; i++) {
+        fprintf(stderr, "  %-18s %12ld\n", counter[i], value[i]);
+    }
+    fprintf(stderr, "%-20s %12s %9s\n", "table", "used", "capacity");
+    for (i = 0; i < ntables; i++) {
+        fprintf(stderr, "  %-18s %12ld %9ld\n", table[i], used[i], capacity[i]);
+    }
+    fprintf(stderr, "%-20s %12s\n", "function", "instructions");
+    for (i = 0; i < nfuncs; i++) {
+        if (!functions[i]->defined) continue;
+        fprintf(stderr, "  %-18s %12d\n", functions[i]->name, functions[i]->insns);
+    }
+}
+
+/* Drop what was kept for the unit just read: its tokens and source text */
+void end_unit(void) {
+    arena_reset(&unit_arena);
+    memset(&unit_tokens, 0, sizeof(unit_tokens));
+    tokpos = 0;
+    lptr = "";
+    srctext = NULL;
+    srcoff = NULL;
+    lineinsns = NULL;
+    nsrclines = 0;
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-arm64|-x64] [-fno-builtin] [-mbaseline] [-mlzcnt] [-mbmi]\n"
+            "       [-fprofile-generate|-fprofile-use[=file]] [-stats[=json]]\n"
+            "       [-annotate] [-g] [-fstack-usage] [-fstack-size-section] source.c\n", prog);
+    fprintf(stderr, "       %s [options] -whole source.c...\n", prog);
+}
+
+int main(int argc, char **argv) {
+    char **units = malloc(argc * sizeof(char *)), *profile = NULL, *report;
+    int i, nunits = 0, stack_usage_opt = 0;
+    
     filename = NULL;
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-arm64")) {
             target = TARGET_ARM64;
         } else if (!strcmp(argv[i], "-x64")) {
             target = TARGET_X64;
+        } else if (!strcmp(argv[i], "-fno-builtin")) {
+            use_builtins = 0;
+        } else if (!strcmp(argv[i], "-mbaseline")) {
+            use_popcnt = use_lzcnt = use_tzcnt = 0;
+        } else if (!strcmp(argv[i], "-mlzcnt")) {
+            use_lzcnt = 1;
+        } else if (!strcmp(argv[i], "-mbmi")) {
+            use_tzcnt = 1;
+        } else if (!strcmp(argv[i], "-whole")) {
+            whole = 1;
+        } else if (!strcmp(argv[i], "-stats") || !strcmp(argv[i], "-ftime-report")) {
+            stats = 1;
+        } else if (!strcmp(argv[i], "-stats=json")) {
+            stats = 2;
+        } else if (!strcmp(argv[i], "-annotate")) {
+            annotate = 1;
+        } else if (!strcmp(argv[i], "-g")) {
+            debug_lines = 1;
+        } else if (!strcmp(argv[i], "-fstack-usage")) {
+            stack_usage_opt = 1;
+        } else if (!strcmp(argv[i], "-fstack-size-section")) {
+            stack_section = 1;
+        } else if (!strcmp(argv[i], "-fprofile-generate")) {
+            profile_gen = 1;
+        } else if (!strcmp(argv[i], "-fprofile-use")) {
+            profile_use = 1;
+            profile = "scc.prof";
+        } else if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+            profile_use = 1;
+            profile = argv[i] + 14;
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
-            fprintf(stderr, "Usage: %s [-arm64|-x64] source.c\n", argv[0]);
+            usage(argv[0]);
             return 1;
         } else {
-            if (filename) {
-                fprintf(stderr, "Error: Multiple source files specified\n");
-                fprintf(stderr, "Usage: %s [-arm64|-x64] source.c\n", argv[0]);
-                return 1;
-            }
-            filename = argv[i];
+            units[nunits++] = argv[i];
         }
     }
     
-    if (!filename) {
-        fprintf(stderr, "Usage: %s [-arm64|-x64] source.c\n", argv[0]);
+    if (!nunits) {
+        usage(argv[0]);
         return 1;
     }
-    
-    input = fopen(filename, "r");
-    if (!input) {
-        perror(filename);
+    if (nunits > 1 && !whole) {
+        fprintf(stderr, "Error: Multiple source files need -whole\n");
+        usage(argv[0]);
+        return 1;
+    }
+    if (profile_gen && profile_use) {
+        fprintf(stderr, "Error: -fprofile-generate and -fprofile-use exclude each other\n");
         return 1;
     }
+    if (stats) phase_t0 = now();
+    if (profile_use) load_profile(profile);
+    
+    /* -fstack-usage: the report goes next to the (first) source, with
+     * .su in place of .c */
+    if (stack_usage_opt) {
+        i = strlen(units[0]);
+        if (i > 2 && !strcmp(units[0] + i - 2, ".c")) i -= 2;
+        report = arena_printf(&perm_arena, "%.*s.su", i, units[0]);
+        stack_report = fopen(report, "w");
+        if (!stack_report) {
+            perror(report);
+            return 1;
+        }
+    }
+    
+    /* -whole: find the inline candidates of every unit first */
+    phase_enter(PH_PRESCAN);
+    for (i = 0; whole && i < nunits; i++) {
+        filename = units[i];
+        input = fopen(filename, "r");
+        if (!input) {
+            perror(filename);
+            return 1;
+        }
+        lineno = 1;
+        scan_inlines();
+        fclose(input);
+        end_unit();
+    }
+    phase_enter(PH_PARSE);
     
     /* Initialize globals */
     nglobals = 0;
@@ -1679,18 +5419,50 @@ int main(int argc, char **argv) {
     lineno = 1;
     lab = 1;
     wsp = 0;
+    nstrlits = 0;
+    strptr = 0;
+    memset(strhash, -1, sizeof(strhash));
+    memset(globhash, -1, sizeof(globhash));
+    memset(funchash, -1, sizeof(funchash));
     
     emit_prolog();
-    program();
-    
-    fclose(input);
+    for (i = 0; (annotate || debug_lines) && i < nunits; i++) {
+        emit(".file %d \"%s\"", i + 1, units[i]);
+    }
+    for (i = 0; i < nunits; i++) {
+        filename = units[i];
+        input = fopen(filename, "r");
+        if (!input) {
+            perror(filename);
+            return 1;
+        }
+        lineno = 1;
+        unitno = i + 1;
+        if (annotate) load_source(filename);
+        program();
+        fclose(input);
+        end_unit();
+    }
+    input = NULL;
+    phase_enter(PH_OUTPUT);
+    if (whole) whole_output();
+    if (profile_gen) emit_profile_table();
+    emit_string_pool();
+    if (annotate) annotate_summary();
+    phase_enter(PH_PARSE);
     
-    /* Check if main function was defined */
+    /* A -whole program must define main; a unit alone may leave it to
+     * another object */
     struct function *main_func = lookup_func("main");
-    if (!main_func || !main_func->defined) {
+    if (whole && (!main_func || !main_func->defined)) {
         error("main function not defined");
         return 1;
     }
     
+    if (stack_report) fclose(stack_report);
+    if (stats) {
+        fflush(stdout);
+        print_stats(units, nunits);
+    }
     return 0;
 }
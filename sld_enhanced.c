@@ -24,6 +24,7 @@
 #define SHT_NOTE 7
 #define SHT_NOBITS 8
 #define SHT_REL 9
+#define SHT_X86_64_UNWIND 0x70000001
 
 /* Section flags */
 #define SHF_WRITE 1
@@ -70,17 +71,25 @@
 
 /* Maximum sizes */
 #define MAX_SECTIONS 64
-#define MAX_SYMBOLS 2048
-#define MAX_RELOCS 4096
+#define MAX_SYMBOLS 8192    /* globals, and the locals relocations name */
+#define MAX_RELOCS 16384
+#define MAX_PIECES 512      /* input sections over all objects */
+#define MAX_OBJ_SECTIONS 256
 #define MAX_NAME 256
 #define MAX_FILES 32
 #define BUF_SIZE 262144 /* 256KB */
 #define OUTPUT_SIZE 1048576 /* 1MB */
+#define STRTAB_SIZE 65536
 
 /* Global data */
 char output[OUTPUT_SIZE];
 int output_size;
 
+/* Contents of the input sections, kept until every object is read and
+ * the size of each output section is known */
+char input_data[OUTPUT_SIZE];
+int input_size;
+
 /* Section tracking */
 struct {
     char name[MAX_NAME];
@@ -116,9 +125,25 @@ struct {
 } relocs[MAX_RELOCS];
 int reloc_count;
 
+/* Input sections: where in their output section they go */
+struct {
+    int section;
+    int offset;
+    int size;
+    char *data;
+} pieces[MAX_PIECES];
+int piece_count;
+
 /* Architecture flag */
 int is_arm64 = 0;
 
+/* Symbol and section header tables written after the sections */
+char symtab[(MAX_SYMBOLS + 1) * 24];
+char strtab[STRTAB_SIZE];
+char shstrtab[STRTAB_SIZE];
+char shdrs[(MAX_SECTIONS + 4) * 64];
+int symtab_size, strtab_size, shstrtab_size, shdr_count;
+
 /* Helper functions */
 int read_u8(char *buf) {
     return buf[0] & 0xFF;
@@ -150,6 +175,12 @@ void write_u64(char *buf, int val) {
     write_u32(buf + 4, 0);
 }
 
+/* Sections kept in the file but not loaded: the DWARF line tables and
+ * the rest of the debug info, for gdb and perf */
+int is_debug(char *name) {
+    return strncmp(name, ".debug_", 7) == 0;
+}
+
 /* Find or add section */
 int find_section(char *name) {
     int i;
@@ -163,22 +194,37 @@ int find_section(char *name) {
 
 int add_section(char *name, int type, int flags, int align) {
     int idx = find_section(name);
-    if (idx >= 0) return idx;
+    if (idx >= 0) {
+        /* Merged sections keep the strictest alignment of their inputs */
+        if (align > sections[idx].align) sections[idx].align = align;
+        return idx;
+    }
     
     strcpy(sections[section_count].name, name);
     sections[section_count].type = type;
     sections[section_count].flags = flags;
     sections[section_count].align = align;
     sections[section_count].size = 0;
-    sections[section_count].data = output + output_size;
+    sections[section_count].data = 0;   /* set by gather_sections */
     return section_count++;
 }
 
-/* Find or add symbol */
+/* Alignment a section is placed at: what its inputs asked for (.balign
+ * in the assembler becomes sh_addralign), but at least SECTION_ALIGN */
+int section_align(int i) {
+    return sections[i].align > SECTION_ALIGN ? sections[i].align : SECTION_ALIGN;
+}
+
+int align_up(int addr, int align) {
+    return (addr + align - 1) & ~(align - 1);
+}
+
+/* Find or add symbol; locals belong to one object and are not found
+ * by name */
 int find_symbol(char *name) {
     int i;
     for (i = 0; i < symbol_count; i++) {
-        if (strcmp(symbols[i].name, name) == 0) {
+        if (symbols[i].binding != STB_LOCAL && strcmp(symbols[i].name, name) == 0) {
             return i;
         }
     }
@@ -186,8 +232,12 @@ int find_symbol(char *name) {
 }
 
 int add_symbol(char *name, int section, int value, int size, int type, int binding) {
-    int idx = find_symbol(name);
+    int idx = binding == STB_LOCAL ? -1 : find_symbol(name);
     if (idx < 0) {
+        if (symbol_count >= MAX_SYMBOLS) {
+            puts("Error: Too many symbols\n");
+            return -1;
+        }
         idx = symbol_count++;
         strcpy(symbols[idx].name, name);
         symbols[idx].section = section;
@@ -200,13 +250,33 @@ int add_symbol(char *name, int section, int value, int size, int type, int bindi
     return idx;
 }
 
-/* Process ELF object file */
+/* Keep the contents of an input section for gather_sections */
+int add_piece(int section, int offset, char *data, int size) {
+    if (piece_count >= MAX_PIECES || input_size + size > OUTPUT_SIZE) {
+        puts("Error: Too many or too large input sections\n");
+        return -1;
+    }
+    pieces[piece_count].section = section;
+    pieces[piece_count].offset = offset;
+    pieces[piece_count].size = size;
+    pieces[piece_count].data = input_data + input_size;
+    memcpy(input_data + input_size, data, size);
+    input_size += size;
+    piece_count++;
+    return 0;
+}
+
+/* Process ELF object file. Its sections are appended to the output
+ * sections of the same name, so its symbols and relocations are moved
+ * by where each of its sections starts there. */
 int process_object(char *filename) {
     static char filebuf[BUF_SIZE];
+    static int sect_map[MAX_OBJ_SECTIONS], sect_base[MAX_OBJ_SECTIONS];
+    static int sym_map[MAX_SYMBOLS];
     int fd, size, i, j;
     char *shstrtab, *strtab;
     int shnum, shoff, shentsize;
-    int machine;
+    int machine, nsyms = 0;
     
     fd = open(filename, 0);
     if (fd < 0) {
@@ -232,139 +302,201 @@ int process_object(char *filename) {
         return -1;
     }
     
-    /* Get section headers */
-    shoff = read_u32(filebuf + 32);
-    shentsize = read_u16(filebuf + 46);
-    shnum = read_u16(filebuf + 48);
+    /* Get section headers (ELF64; offsets and sizes fit in 32 bits) */
+    shoff = read_u32(filebuf + 40);
+    shentsize = read_u16(filebuf + 58);
+    shnum = read_u16(filebuf + 60);
+    if (shnum > MAX_OBJ_SECTIONS) {
+        puts("Error: Too many sections\n");
+        return -1;
+    }
     
     /* Get section name string table */
-    i = read_u16(filebuf + 50);
-    shstrtab = filebuf + read_u32(filebuf + shoff + i * shentsize + 16);
+    i = read_u16(filebuf + 62);
+    shstrtab = filebuf + read_u32(filebuf + shoff + i * shentsize + 24);
     
     /* First pass: collect sections */
+    sect_map[0] = -1;
     for (i = 1; i < shnum; i++) {
         char *shdr = filebuf + shoff + i * shentsize;
         char *name = shstrtab + read_u32(shdr);
         int type = read_u32(shdr + 4);
         int flags = read_u32(shdr + 8);
-        int offset = read_u32(shdr + 16);
-        int sh_size = read_u32(shdr + 20);
-        int align = read_u32(shdr + 32);
+        int offset = read_u32(shdr + 24);
+        int sh_size = read_u32(shdr + 32);
+        int align = read_u32(shdr + 48);
         
-        if (type == SHT_PROGBITS && (flags & SHF_ALLOC)) {
+        sect_map[i] = -1;
+        if (type == SHT_X86_64_UNWIND) type = SHT_PROGBITS;  /* .eh_frame */
+        if ((type == SHT_PROGBITS && ((flags & SHF_ALLOC) || is_debug(name))) ||
+            (type == SHT_NOBITS && (flags & SHF_ALLOC))) {
             int sect = add_section(name, type, flags, align);
             
-            /* Append data */
-            memcpy(sections[sect].data + sections[sect].size, 
-                   filebuf + offset, sh_size);
-            sections[sect].size += sh_size;
-            output_size += sh_size;
-            
-            /* Align output */
-            while (output_size & (SECTION_ALIGN - 1)) {
-                output[output_size++] = 0;
+            /* Append at the input's alignment; BSS only takes space */
+            sect_map[i] = sect;
+            sect_base[i] = align_up(sections[sect].size, align > 1 ? align : 1);
+            sections[sect].size = sect_base[i] + sh_size;
+            if (type == SHT_PROGBITS &&
+                add_piece(sect, sect_base[i], filebuf + offset, sh_size) < 0) {
+                return -1;
             }
-        } else if (type == SHT_NOBITS && (flags & SHF_ALLOC)) {
-            /* BSS section */
-            int sect = add_section(name, type, flags, align);
-            sections[sect].size += sh_size;
         }
     }
     
-    /* Second pass: collect symbols and relocations */
+    /* Second pass: collect symbols */
     for (i = 0; i < shnum; i++) {
         char *shdr = filebuf + shoff + i * shentsize;
         int type = read_u32(shdr + 4);
-        int offset = read_u32(shdr + 16);
-        int sh_size = read_u32(shdr + 20);
-        int link = read_u32(shdr + 24);
-        int info = read_u32(shdr + 28);
-        int entsize = read_u32(shdr + 36);
+        int offset = read_u32(shdr + 24);
+        int sh_size = read_u32(shdr + 32);
+        int link = read_u32(shdr + 40);
+        int entsize = read_u32(shdr + 56);
         
         if (type == SHT_SYMTAB) {
             /* Get string table for symbols */
-            strtab = filebuf + read_u32(filebuf + shoff + link * shentsize + 16);
+            strtab = filebuf + read_u32(filebuf + shoff + link * shentsize + 24);
+            nsyms = sh_size / entsize;
+            if (nsyms > MAX_SYMBOLS) {
+                puts("Error: Too many symbols\n");
+                return -1;
+            }
             
             /* Process symbols */
-            for (j = 0; j < sh_size; j += entsize) {
-                char *sym = filebuf + offset + j;
+            sym_map[0] = -1;
+            for (j = 1; j < nsyms; j++) {
+                char *sym = filebuf + offset + j * entsize;
                 char *name = strtab + read_u32(sym);
-                int value = read_u32(sym + 4);
-                int size = read_u32(sym + 8);
-                int st_info = read_u8(sym + 12);
-                int shndx = read_u16(sym + 14);
+                int st_info = read_u8(sym + 4);
+                int shndx = read_u16(sym + 6);
+                int value = read_u32(sym + 8);
+                int size = read_u32(sym + 16);
                 int binding = st_info >> 4;
                 int stype = st_info & 0xF;
+                int sect = -1, idx;
                 
-                if (*name && binding != STB_LOCAL) {
-                    /* Map section index */
-                    int sect = -1;
-                    if (shndx > 0 && shndx < shnum) {
-                        char *sect_name = shstrtab + 
-                            read_u32(filebuf + shoff + shndx * shentsize);
-                        sect = find_section(sect_name);
-                    }
-                    
-                    int idx = add_symbol(name, sect, value, size, stype, binding);
-                    if (sect >= 0) {
-                        symbols[idx].defined = 1;
-                    }
+                /* Map section index */
+                if (shndx > 0 && shndx < shnum) {
+                    sect = sect_map[shndx];
+                    if (sect >= 0) value += sect_base[shndx];
                 }
-            }
-        } else if (type == SHT_RELA) {
-            /* Get target section */
-            char *target_name = shstrtab + 
-                read_u32(filebuf + shoff + info * shentsize);
-            int target_sect = find_section(target_name);
-            
-            if (target_sect >= 0) {
-                /* Process relocations */
-                for (j = 0; j < sh_size; j += entsize) {
-                    char *rel = filebuf + offset + j;
-                    relocs[reloc_count].offset = read_u32(rel);
-                    relocs[reloc_count].type = read_u32(rel + 8);
-                    relocs[reloc_count].symbol = read_u32(rel + 12);
-                    relocs[reloc_count].addend = read_u32(rel + 16);
-                    relocs[reloc_count].section = target_sect;
-                    reloc_count++;
+                
+                /* Locals (section symbols, string literal labels) get
+                 * an entry of their own for the relocations to use;
+                 * add_symbol does not merge them by name */
+                if (!*name && binding != STB_LOCAL) {
+                    sym_map[j] = -1;
+                    continue;
+                }
+                idx = add_symbol(name, sect, value, size, stype, binding);
+                if (idx < 0) return -1;
+                if (sect >= 0 && !symbols[idx].defined) {
+                    symbols[idx].section = sect;
+                    symbols[idx].value = value;
+                    symbols[idx].size = size;
+                    symbols[idx].type = stype;
+                    symbols[idx].binding = binding;
+                    symbols[idx].defined = 1;
                 }
+                sym_map[j] = idx;
             }
         }
     }
     
+    /* Third pass: collect relocations of the sections kept */
+    for (i = 0; i < shnum; i++) {
+        char *shdr = filebuf + shoff + i * shentsize;
+        int type = read_u32(shdr + 4);
+        int offset = read_u32(shdr + 24);
+        int sh_size = read_u32(shdr + 32);
+        int info = read_u32(shdr + 44);
+        int entsize = read_u32(shdr + 56);
+        
+        if (type != SHT_RELA || info >= shnum || sect_map[info] < 0) continue;
+        for (j = 0; j < sh_size; j += entsize) {
+            char *rel = filebuf + offset + j;
+            int symidx = read_u32(rel + 12);
+            if (reloc_count >= MAX_RELOCS) {
+                puts("Error: Too many relocations\n");
+                return -1;
+            }
+            relocs[reloc_count].offset = sect_base[info] + read_u32(rel);
+            relocs[reloc_count].type = read_u32(rel + 8);
+            relocs[reloc_count].symbol = symidx < nsyms ? sym_map[symidx] : -1;
+            relocs[reloc_count].addend = read_u32(rel + 16);
+            relocs[reloc_count].section = sect_map[info];
+            reloc_count++;
+        }
+    }
+    
+    return 0;
+}
+
+/* Give each section its place in the output buffer, now that all the
+ * objects are read, and copy in its pieces */
+int gather_sections() {
+    int i;
+    
+    output_size = 0;
+    for (i = 0; i < section_count; i++) {
+        if (sections[i].type == SHT_NOBITS) continue;
+        output_size = align_up(output_size, section_align(i));
+        if (output_size + sections[i].size > OUTPUT_SIZE) {
+            puts("Error: Output too large\n");
+            return -1;
+        }
+        sections[i].data = output + output_size;
+        output_size += sections[i].size;
+    }
+    for (i = 0; i < piece_count; i++) {
+        memcpy(sections[pieces[i].section].data + pieces[i].offset,
+               pieces[i].data, pieces[i].size);
+    }
     return 0;
 }
 
-/* Layout sections in memory */
+/* Place of a code section: hot functions (.text.hot) first so they
+ * share pages, then the rest, and code that never ran (.text.unlikely)
+ * last */
+int text_rank(char *name) {
+    if (strncmp(name, ".text.hot", 9) == 0) return 0;
+    if (strncmp(name, ".text.unlikely", 14) == 0) return 2;
+    return 1;
+}
+
+/* Layout sections in memory; each starts at its own alignment, or
+ * SECTION_ALIGN if that is larger */
 void layout_sections() {
     int vaddr = BASE_ADDR + PAGE_SIZE;
-    int i;
+    int i, rank;
     
     /* Layout code sections first */
-    for (i = 0; i < section_count; i++) {
-        if (sections[i].flags & SHF_EXECINSTR) {
-            sections[i].vaddr = vaddr;
-            vaddr += sections[i].size;
-            vaddr = (vaddr + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
+    for (rank = 0; rank < 3; rank++) {
+        for (i = 0; i < section_count; i++) {
+            if ((sections[i].flags & SHF_EXECINSTR) && text_rank(sections[i].name) == rank) {
+                vaddr = align_up(vaddr, section_align(i));
+                sections[i].vaddr = vaddr;
+                vaddr += sections[i].size;
+            }
         }
     }
     
-    /* Then data sections */
-    vaddr = (vaddr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    /* Then data sections; debug sections are not loaded and stay at 0 */
+    vaddr = align_up(vaddr, PAGE_SIZE);
     for (i = 0; i < section_count; i++) {
-        if (!(sections[i].flags & SHF_EXECINSTR) && sections[i].type != SHT_NOBITS) {
+        if (!(sections[i].flags & SHF_EXECINSTR) && (sections[i].flags & SHF_ALLOC) &&
+            sections[i].type != SHT_NOBITS) {
+            vaddr = align_up(vaddr, section_align(i));
             sections[i].vaddr = vaddr;
             vaddr += sections[i].size;
-            vaddr = (vaddr + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
         }
     }
     
     /* Finally BSS */
     for (i = 0; i < section_count; i++) {
         if (sections[i].type == SHT_NOBITS) {
+            vaddr = align_up(vaddr, section_align(i));
             sections[i].vaddr = vaddr;
             vaddr += sections[i].size;
-            vaddr = (vaddr + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
         }
     }
 }
@@ -384,12 +516,12 @@ void apply_relocations() {
         int pc = sections[sect].vaddr + offset;
         int target = 0;
         
-        if (sym < symbol_count && symbols[sym].defined) {
+        if (sym >= 0 && symbols[sym].defined) {
             int sym_sect = symbols[sym].section;
             if (sym_sect >= 0) {
                 target = sections[sym_sect].vaddr + symbols[sym].value;
             }
-        } else if (sym < symbol_count) {
+        } else if (sym >= 0) {
             printf("Warning: undefined symbol %s\n", symbols[sym].name);
             continue;
         }
@@ -456,6 +588,138 @@ void apply_relocations() {
     }
 }
 
+/* Add a name to a string table, returning its offset */
+int add_string(char *tab, int *size, char *name) {
+    int off = *size;
+    int len = strlen(name) + 1;
+    if (off + len > STRTAB_SIZE) {
+        puts("Error: Too many section or symbol names\n");
+        return -1;
+    }
+    memcpy(tab + off, name, len);
+    *size += len;
+    return off;
+}
+
+/* Fill in the next section header */
+int add_shdr(char *name, int type, int flags, int addr, int offset, int size,
+             int link, int info, int align, int entsize) {
+    char *sh = shdrs + shdr_count * 64;
+    int n = add_string(shstrtab, &shstrtab_size, name);
+    if (n < 0) return -1;
+    write_u32(sh, n);
+    write_u32(sh + 4, type);
+    write_u64(sh + 8, flags);
+    write_u64(sh + 16, addr);
+    write_u64(sh + 24, offset);
+    write_u64(sh + 32, size);
+    write_u32(sh + 40, link);
+    write_u32(sh + 44, info);
+    write_u64(sh + 48, align);
+    write_u64(sh + 56, entsize);
+    return shdr_count++;
+}
+
+/* Place the sections in the file: loaded ones at the offset of their
+ * address, the debug sections after them. Returns the end offset. */
+int place_sections() {
+    int i, end = PAGE_SIZE;
+    
+    for (i = 0; i < section_count; i++) {
+        if ((sections[i].flags & SHF_ALLOC) && sections[i].type != SHT_NOBITS) {
+            sections[i].file_offset = sections[i].vaddr - BASE_ADDR;
+            if (sections[i].file_offset + sections[i].size > end) {
+                end = sections[i].file_offset + sections[i].size;
+            }
+        }
+    }
+    for (i = 0; i < section_count; i++) {
+        if (!(sections[i].flags & SHF_ALLOC)) {
+            sections[i].file_offset = end;
+            end += sections[i].size;
+        }
+    }
+    return end;
+}
+
+/* Build the symbol table of the defined symbols and the section header
+ * table, to follow the sections from file offset off, and point the ELF
+ * header at them. gdb, perf and addr2line need both to name functions
+ * and to find the debug sections. */
+int build_section_headers(char *header, int off) {
+    static int shndx[MAX_SECTIONS];
+    int i, symoff, stroff, shstroff, symtab_index;
+    char *sym;
+    
+    memset(shdrs, 0, sizeof(shdrs));
+    memset(symtab, 0, sizeof(symtab));
+    strtab[0] = shstrtab[0] = 0;
+    strtab_size = shstrtab_size = 1;
+    symtab_size = 24;
+    shdr_count = 1;
+    
+    for (i = 0; i < section_count; i++) {
+        shndx[i] = 0;
+        if (sections[i].size == 0) continue;
+        shndx[i] = add_shdr(sections[i].name, sections[i].type, sections[i].flags,
+                            sections[i].vaddr,
+                            sections[i].type == SHT_NOBITS ? 0 : sections[i].file_offset,
+                            sections[i].size, 0, 0,
+                            (sections[i].flags & SHF_ALLOC) ? section_align(i) : 1, 0);
+        if (shndx[i] < 0) return -1;
+    }
+    
+    for (i = 0; i < symbol_count; i++) {
+        int sect = symbols[i].section;
+        int name;
+        if (!symbols[i].defined || symbols[i].binding == STB_LOCAL ||
+            sect < 0 || !shndx[sect]) continue;
+        if ((name = add_string(strtab, &strtab_size, symbols[i].name)) < 0) return -1;
+        sym = symtab + symtab_size;
+        write_u32(sym, name);
+        sym[4] = (symbols[i].binding << 4) | symbols[i].type;
+        write_u16(sym + 6, shndx[sect]);
+        write_u64(sym + 8, sections[sect].vaddr + symbols[i].value);
+        write_u64(sym + 16, symbols[i].size);
+        symtab_size += 24;
+    }
+    
+    /* .symtab, .strtab, .shstrtab, then the headers */
+    symoff = align_up(off, 8);
+    stroff = symoff + symtab_size;
+    symtab_index = shdr_count;
+    if (add_shdr(".symtab", SHT_SYMTAB, 0, 0, symoff, symtab_size,
+                 symtab_index + 1, 1, 8, 24) < 0) return -1;
+    if (add_shdr(".strtab", SHT_STRTAB, 0, 0, stroff, strtab_size, 0, 0, 1, 0) < 0) return -1;
+    shstroff = stroff + strtab_size;
+    if (add_shdr(".shstrtab", SHT_STRTAB, 0, 0, shstroff, 0, 0, 0, 1, 0) < 0) return -1;
+    write_u64(shdrs + (shdr_count - 1) * 64 + 32, shstrtab_size);
+    
+    write_u64(header + 40, align_up(shstroff + shstrtab_size, 8));
+    write_u16(header + 58, 64);
+    write_u16(header + 60, shdr_count);
+    write_u16(header + 62, shdr_count - 1);
+    return 0;
+}
+
+/* Write the tables build_section_headers laid out, the file being at
+ * offset off */
+void write_section_headers(int fd, int off) {
+    while (off & 7) {
+        write(fd, "", 1);
+        off++;
+    }
+    write(fd, symtab, symtab_size);
+    write(fd, strtab, strtab_size);
+    write(fd, shstrtab, shstrtab_size);
+    off += symtab_size + strtab_size + shstrtab_size;
+    while (off & 7) {
+        write(fd, "", 1);
+        off++;
+    }
+    write(fd, shdrs, shdr_count * 64);
+}
+
 /* Write output executable */
 int write_executable(char *filename) {
     static char header[PAGE_SIZE];
@@ -489,7 +753,7 @@ int write_executable(char *filename) {
     write_u32(header + 20, EV_CURRENT);
     write_u64(header + 24, entry_addr);
     write_u64(header + 32, 64); /* Program header offset */
-    write_u64(header + 40, 0);  /* Section header offset */
+    write_u64(header + 40, 0);  /* Section header offset, set below */
     write_u32(header + 48, 0);  /* Flags */
     write_u16(header + 52, 64); /* ELF header size */
     write_u16(header + 54, 56); /* Program header size */
@@ -524,7 +788,8 @@ int write_executable(char *filename) {
     int data_start = 0x7FFFFFFF;
     int data_end = 0;
     for (i = 0; i < section_count; i++) {
-        if (!(sections[i].flags & SHF_EXECINSTR) && sections[i].size > 0) {
+        if (!(sections[i].flags & SHF_EXECINSTR) && (sections[i].flags & SHF_ALLOC) &&
+            sections[i].size > 0) {
             if (sections[i].vaddr < data_start) 
                 data_start = sections[i].vaddr;
             if (sections[i].vaddr + sections[i].size > data_end)
@@ -546,22 +811,38 @@ int write_executable(char *filename) {
     write_u32(ph, PT_GNU_STACK);
     write_u32(ph + 4, PF_R | PF_W);
     
+    /* Section headers */
+    int end = place_sections();
+    if (build_section_headers(header, end) < 0) {
+        close(fd);
+        return -1;
+    }
+    
     /* Write header */
     write(fd, header, PAGE_SIZE);
     
-    /* Write sections */
+    /* Write sections in file order; with .text.hot placed first that
+     * is not the order they were read in */
     int file_offset = PAGE_SIZE;
-    for (i = 0; i < section_count; i++) {
-        if (sections[i].type != SHT_NOBITS && sections[i].size > 0) {
-            int padding = sections[i].vaddr - BASE_ADDR - file_offset;
-            while (padding-- > 0) {
-                write(fd, "", 1);
-                file_offset++;
+    for (;;) {
+        int next = -1;
+        for (i = 0; i < section_count; i++) {
+            if (sections[i].type != SHT_NOBITS && sections[i].size > 0 &&
+                sections[i].file_offset >= file_offset &&
+                (next < 0 || sections[i].file_offset < sections[next].file_offset)) {
+                next = i;
             }
-            write(fd, sections[i].data, sections[i].size);
-            file_offset += sections[i].size;
         }
+        if (next < 0) break;
+        int padding = sections[next].file_offset - file_offset;
+        while (padding-- > 0) {
+            write(fd, "", 1);
+            file_offset++;
+        }
+        write(fd, sections[next].data, sections[next].size);
+        file_offset += sections[next].size;
     }
+    write_section_headers(fd, file_offset);
     
     close(fd);
     chmod(filename, 0755);
@@ -597,7 +878,8 @@ int main(int argc, char *argv[]) {
     section_count = 0;
     symbol_count = 0;
     reloc_count = 0;
-    output_size = 0;
+    piece_count = 0;
+    input_size = 0;
     
     /* Process all object files */
     for (i = 0; i < file_count; i++) {
@@ -606,7 +888,10 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    /* Layout sections */
+    /* Lay out the data, then the sections in memory */
+    if (gather_sections() < 0) {
+        return 1;
+    }
     layout_sections();
     
     /* Apply relocations */
@@ -49,10 +49,11 @@ void processline(char *line);
 void substitute(char *line);
 int copyword(char *dst, char *src);
 void processfile(int fd, char *name);
-void expandmacro(char *dst, int defidx, char *args);
+void expandmacro(char *dst, int defidx, char args[][MAXNAMESIZE]);
 int parsemacroargs(char *src, char args[][MAXNAMESIZE]);
 void error(char *msg);
 void undefine(char *name);
+char *itoa(int n);
 
 int main(int argc, char **argv) {
     int fd;
@@ -0,0 +1,331 @@
+/* sstack.c - Worst-case stack depth of Small-C programs */
+/* Reads the .stack_sizes sections scc_enhanced writes with
+ * -fstack-size-section and the calls in the code of each object, and
+ * adds up the frames along the deepest path of the call graph. */
+
+/* ELF constants */
+#define SHT_SYMTAB 2
+#define SHT_RELA 4
+#define SHF_EXECINSTR 4
+#define STT_FUNC 2
+#define EM_AARCH64 183
+#define EM_X86_64 62
+
+/* Relocations that mark a call */
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+#define R_AARCH64_JUMP26 282
+#define R_AARCH64_CALL26 283
+
+/* Limits */
+#define MAX_FUNCS 2048
+#define MAX_CALLS 8192
+#define MAX_NAME 128
+#define MAX_FILES 32
+#define BUF_SIZE 1048576 /* 1MB */
+
+/* Depth states */
+#define UNKNOWN -1
+#define ACTIVE -2       /* on the path being searched: recursion */
+
+/* Functions: defined ones have an address in their object, those with
+ * an entry in .stack_sizes a frame size */
+struct {
+    char name[MAX_NAME];
+    int file;
+    int section;
+    int value;
+    int size;
+    int frame;          /* UNKNOWN if no .stack_sizes entry */
+    int depth;          /* worst case including calls, or a state */
+    int next;           /* callee on the deepest path, or -1 */
+    int recursive;
+    int incomplete;     /* a function on the path has no frame size */
+} funcs[MAX_FUNCS];
+int func_count;
+
+/* Call graph edges */
+struct {
+    int caller;
+    int callee;
+} calls[MAX_CALLS];
+int call_count;
+
+/* Helper functions */
+int read_u8(char *buf) {
+    return *buf & 0xFF;
+}
+
+int read_u16(char *buf) {
+    return (buf[0] & 0xFF) | ((buf[1] & 0xFF) << 8);
+}
+
+int read_u32(char *buf) {
+    return (buf[0] & 0xFF) | ((buf[1] & 0xFF) << 8) |
+           ((buf[2] & 0xFF) << 16) | ((buf[3] & 0xFF) << 24);
+}
+
+/* Find or add function */
+int find_func(char *name) {
+    int i;
+    for (i = 0; i < func_count; i++) {
+        if (strcmp(funcs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int add_func(char *name) {
+    int idx = find_func(name);
+    if (idx >= 0) return idx;
+
+    if (func_count >= MAX_FUNCS) {
+        puts("Error: Too many functions\n");
+        exit(1);
+    }
+    idx = func_count++;
+    strncpy(funcs[idx].name, name, MAX_NAME - 1);
+    funcs[idx].file = -1;
+    funcs[idx].section = -1;
+    funcs[idx].frame = UNKNOWN;
+    funcs[idx].depth = UNKNOWN;
+    funcs[idx].next = -1;
+    return idx;
+}
+
+/* Function of this object whose code holds offset in section */
+int func_at(int file, int section, int offset) {
+    int i;
+    for (i = 0; i < func_count; i++) {
+        if (funcs[i].file == file && funcs[i].section == section &&
+            offset >= funcs[i].value && offset < funcs[i].value + funcs[i].size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void add_call(int caller, int callee) {
+    int i;
+    for (i = 0; i < call_count; i++) {
+        if (calls[i].caller == caller && calls[i].callee == callee) return;
+    }
+    if (call_count >= MAX_CALLS) {
+        puts("Error: Too many calls\n");
+        exit(1);
+    }
+    calls[call_count].caller = caller;
+    calls[call_count].callee = callee;
+    call_count++;
+}
+
+/* Process ELF object file */
+int process_object(char *filename, int file) {
+    static char filebuf[BUF_SIZE];
+    int fd, size, i, j;
+    char *shstrtab, *strtab = 0, *symtab = 0;
+    int shnum, shoff, shentsize, machine, sym_size = 0;
+
+    fd = open(filename, 0);
+    if (fd < 0) {
+        printf("Error: Cannot open %s\n", filename);
+        return -1;
+    }
+    size = read(fd, filebuf, BUF_SIZE);
+    close(fd);
+
+    if (size < 64 || memcmp(filebuf, "\177ELF", 4) != 0) {
+        printf("Error: %s is not an ELF file\n", filename);
+        return -1;
+    }
+    machine = read_u16(filebuf + 18);
+    if (machine != EM_X86_64 && machine != EM_AARCH64) {
+        printf("Error: %s: Unsupported architecture\n", filename);
+        return -1;
+    }
+
+    shoff = read_u32(filebuf + 40);
+    shentsize = read_u16(filebuf + 58);
+    shnum = read_u16(filebuf + 60);
+    i = read_u16(filebuf + 62);
+    shstrtab = filebuf + read_u32(filebuf + shoff + i * shentsize + 24);
+
+    /* Symbol table */
+    for (i = 1; i < shnum; i++) {
+        char *shdr = filebuf + shoff + i * shentsize;
+        if (read_u32(shdr + 4) == SHT_SYMTAB) {
+            symtab = filebuf + read_u32(shdr + 24);
+            sym_size = read_u32(shdr + 32);
+            strtab = filebuf + read_u32(filebuf + shoff + read_u32(shdr + 40) * shentsize + 24);
+        }
+    }
+    if (!symtab) return 0;
+
+    /* Functions defined here, with their extent from .size */
+    for (j = 24; j < sym_size; j += 24) {
+        char *sym = symtab + j;
+        int shndx = read_u16(sym + 6);
+        int f;
+        if ((read_u8(sym + 4) & 0xF) != STT_FUNC || shndx == 0 || shndx >= shnum) continue;
+        f = add_func(strtab + read_u32(sym));
+        funcs[f].file = file;
+        funcs[f].section = shndx;
+        funcs[f].value = read_u32(sym + 8);
+        funcs[f].size = read_u32(sym + 16);
+    }
+
+    /* Frame sizes and calls, both from the relocations: a .stack_sizes
+     * entry is the function's address, relocated, then the ULEB128
+     * size; a call is a branch relocated against its target */
+    for (i = 1; i < shnum; i++) {
+        char *shdr = filebuf + shoff + i * shentsize;
+        char *target, *tname, *data;
+        int offset, sh_size, info;
+
+        if (read_u32(shdr + 4) != SHT_RELA) continue;
+        offset = read_u32(shdr + 24);
+        sh_size = read_u32(shdr + 32);
+        info = read_u32(shdr + 44);
+        target = filebuf + shoff + info * shentsize;
+        tname = shstrtab + read_u32(target);
+        data = filebuf + read_u32(target + 24);
+
+        for (j = 0; j < sh_size; j += 24) {
+            char *rel = filebuf + offset + j;
+            int r_offset = read_u32(rel);
+            int type = read_u32(rel + 8);
+            int symidx = read_u32(rel + 12);
+            char *name = strtab + read_u32(symtab + symidx * 24);
+
+            if (!*name) continue;
+            if (strcmp(tname, ".stack_sizes") == 0) {
+                char *p = data + r_offset + 8;
+                int frame = 0, shift = 0;
+                while (read_u8(p) & 0x80) {
+                    frame |= (read_u8(p++) & 0x7F) << shift;
+                    shift += 7;
+                }
+                frame |= read_u8(p) << shift;
+                funcs[add_func(name)].frame = frame;
+            } else if (read_u32(target + 8) & SHF_EXECINSTR) {
+                int caller;
+                if (machine == EM_X86_64) {
+                    if (type != R_X86_64_PLT32 && type != R_X86_64_PC32) continue;
+                    if (r_offset < 1 || read_u8(data + r_offset - 1) != 0xE8) continue;
+                } else if (type != R_AARCH64_CALL26 && type != R_AARCH64_JUMP26) {
+                    continue;
+                }
+                caller = func_at(file, info, r_offset);
+                if (caller >= 0) add_call(caller, add_func(name));
+            }
+        }
+    }
+    return 0;
+}
+
+/* Worst-case depth of f: its frame and the deepest of its callees. A
+ * call back into a function on the path is recursion, whose depth has
+ * no bound; it is counted once and flagged. */
+int depth(int f) {
+    int i, d, worst = 0;
+
+    if (funcs[f].depth == ACTIVE) {
+        funcs[f].recursive = 1;
+        return 0;
+    }
+    if (funcs[f].depth != UNKNOWN) return funcs[f].depth;
+
+    funcs[f].depth = ACTIVE;
+    for (i = 0; i < call_count; i++) {
+        if (calls[i].caller != f) continue;
+        d = depth(calls[i].callee);
+        if (funcs[calls[i].callee].recursive) funcs[f].recursive = 1;
+        if (funcs[calls[i].callee].incomplete) funcs[f].incomplete = 1;
+        if (d > worst || funcs[f].next < 0) {
+            if (d > worst) worst = d;
+            funcs[f].next = calls[i].callee;
+        }
+    }
+    if (funcs[f].frame == UNKNOWN) {
+        funcs[f].incomplete = 1;
+    } else {
+        worst += funcs[f].frame;
+    }
+    funcs[f].depth = worst;
+    return worst;
+}
+
+char *flags(int f) {
+    if (funcs[f].recursive && funcs[f].incomplete) return "  recursive, incomplete";
+    if (funcs[f].recursive) return "  recursive";
+    if (funcs[f].incomplete) return "  incomplete";
+    return "";
+}
+
+/* Main function */
+int main(int argc, char *argv[]) {
+    int i, f, steps, file_count = 0;
+    char *entry = 0;
+    char *files[MAX_FILES];
+
+    /* Parse arguments */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            entry = argv[++i];
+        } else if (argv[i][0] == '-') {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        } else {
+            if (file_count >= MAX_FILES) {
+                puts("Error: Too many files\n");
+                return 1;
+            }
+            files[file_count++] = argv[i];
+        }
+    }
+
+    if (file_count == 0) {
+        puts("Usage: sstack [-e entry] file1.o file2.o ...\n");
+        return 1;
+    }
+
+    func_count = 0;
+    call_count = 0;
+    for (i = 0; i < file_count; i++) {
+        if (process_object(files[i], i) < 0) {
+            return 1;
+        }
+    }
+
+    /* Every function, with its own frame and the worst case below it */
+    printf("%-24s %8s %8s\n", "function", "frame", "worst");
+    for (i = 0; i < func_count; i++) {
+        depth(i);
+        if (funcs[i].frame == UNKNOWN) {
+            printf("%-24s %8s %8d%s\n", funcs[i].name, "?", funcs[i].depth, flags(i));
+        } else {
+            printf("%-24s %8d %8d%s\n", funcs[i].name, funcs[i].frame, funcs[i].depth, flags(i));
+        }
+    }
+
+    /* The deepest path from the entry point */
+    if (!entry) {
+        entry = find_func("_start") >= 0 ? "_start" : "main";
+    }
+    f = find_func(entry);
+    if (f < 0) {
+        printf("Error: %s not found\n", entry);
+        return 1;
+    }
+    printf("\nWorst case from %s: %d bytes%s\n", entry, funcs[f].depth, flags(f));
+    for (steps = 0; f >= 0 && steps < func_count; steps++) {
+        if (funcs[f].frame == UNKNOWN) {
+            printf("  %-22s %8s\n", funcs[f].name, "?");
+        } else {
+            printf("  %-22s %8d\n", funcs[f].name, funcs[f].frame);
+        }
+        f = funcs[f].next;
+    }
+    return 0;
+}
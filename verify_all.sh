@@ -45,6 +45,444 @@ esac
 echo "Platform: $OS/$ARCH"
 echo ""
 
+# Regression tests for the enhanced compiler. runtime.c is written for
+# the basic compiler's preprocessor, so these link with a small runtime
+# built by gcc instead; they need only gcc, as and ld.
+echo "Regression tests (enhanced compiler)"
+rm -rf regress
+mkdir regress
+gcc -w -o regress/scc_enhanced scc_enhanced.c
+gcc -w -o regress/sld_enhanced sld_enhanced.c
+gcc -w -o regress/sstack sstack.c
+gcc -w -o regress/scc-driver scc_driver.c
+as syscall_linux_${ARCH}.s -o regress/syscall_linux_${ARCH}.o
+cd regress
+cat > runtime.c << 'EOF'
+long _sys_write(long fd, char *buf, long count);
+long _sys_open(char *path, long flags, long mode);
+long _sys_close(long fd);
+long _sys_exit(long code);
+long write(long fd, char *buf, long count) { return _sys_write(fd, buf, count); }
+long creat(char *path) { return _sys_open(path, 01101, 0644); }
+long close(long fd) { return _sys_close(fd); }
+long fputc(long c, long fd) { char ch = c; write(fd, &ch, 1); return c; }
+long fputs(char *s, long fd) { while (*s) fputc(*s++, fd); return 0; }
+long putchar(long c) { return fputc(c, 1); }
+long puts(char *s) { fputs(s, 1); return putchar('\n'); }
+long putn(long n, long fd) {
+    if (n < 0) { fputc('-', fd); n = -n; }
+    if (n >= 10) putn(n / 10, fd);
+    return fputc(n % 10 + '0', fd);
+}
+long printn(long n) { return putn(n, 1); }
+long printf(char *f, long a, long b, long c, long d, long e) {
+    long args[5] = { a, b, c, d, e }, k = 0;
+    for (; *f; f++) {
+        if (*f != '%') { putchar(*f); continue; }
+        f++;
+        if (*f == 'd') printn(args[k++]);
+        else if (*f == 's') fputs((char *)args[k++], 1);
+        else if (*f == 'c') putchar(args[k++]);
+        else putchar(*f);
+    }
+    return 0;
+}
+long *_prof_tab;
+long _prof_register(long *tab) { tab[0] = (long)_prof_tab; tab[1] = 1; _prof_tab = tab; return 0; }
+long exit(long code) {
+    long *tab, *count, i, fd;
+    if (_prof_tab && (fd = creat("scc.prof")) >= 0) {
+        for (tab = _prof_tab; tab; tab = (long *)tab[0]) {
+            count = (long *)tab[3];
+            for (i = 0; i < tab[2]; i++) {
+                fputs((char *)tab[4 + 3 * i], fd); fputc(' ', fd);
+                fputc(tab[5 + 3 * i], fd); fputc(' ', fd);
+                putn(tab[6 + 3 * i], fd); fputc(' ', fd);
+                putn(count[i], fd); fputc('\n', fd);
+            }
+        }
+        close(fd);
+    }
+    return _sys_exit(code);
+}
+EOF
+gcc -c -O1 -ffreestanding -fno-builtin -fno-pie -fno-stack-protector -w runtime.c -o runtime.o
+
+FAILED=0
+
+# build prog [options] source.c...: compile, assemble and link prog;
+# if a step fails, running prog reports it
+build() {
+    local prog=$1
+    shift
+    rm -f $prog
+    ./scc_enhanced "$@" > $prog.s && as $prog.s -o $prog.o &&
+        ld -static syscall_linux_${ARCH}.o runtime.o $prog.o -o $prog 2>/dev/null || true
+}
+
+# run prog: its output on one line, then the exit status if not 0
+run() {
+    local rc=0
+    ./$1 > $1.out || rc=$?
+    echo $(cat $1.out) $([ $rc = 0 ] || echo "exit $rc")
+}
+
+# check name expected actual
+check() {
+    if [ "$3" = "$2" ]; then
+        echo -e "${GREEN}✓${NC} $1"
+    else
+        echo -e "${RED}✗${NC} $1: expected '$2', got '$3'"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# Value numbering of array elements, with stores through pointers
+cat > vn.c << 'EOF'
+int g[10];
+int gi;
+int f(int x) { g[2] = x; return x; }
+int main() {
+    int a[10];
+    int b[10];
+    int i;
+    int *p;
+    int x;
+    for (i = 0; i < 10; i++) { a[i] = i; b[i] = i + 1; g[i] = 0; }
+    i = 3;
+    a[i] = a[i] + b[i] * b[i];
+    printf("%d\n", a[3]);
+    p = &a[4];
+    x = a[4];
+    *p = 100;
+    x = x + a[4];
+    printf("%d\n", x);
+    g[2] = 5;
+    x = g[2];
+    f(9);
+    x = x + g[2];
+    printf("%d\n", x);
+    gi = 2;
+    x = g[gi];
+    gi = 3;
+    x = x + g[gi];
+    printf("%d\n", x);
+    i = 1;
+    x = a[i];
+    i++;
+    x = x + a[i];
+    printf("%d\n", x);
+    x = a[i] + a[i];
+    a[i] += 5;
+    x = x + a[i];
+    printf("%d\n", x);
+    p = a;
+    x = p[2];
+    a[2] = 50;
+    x = x + p[2];
+    printf("%d\n", x);
+    x = a[2];
+    p[2] = 60;
+    x = x + a[2];
+    printf("%d\n", x);
+    return 0;
+}
+EOF
+build vn vn.c
+check "value numbering" "19 104 14 9 3 11 57 110" "$(run vn)"
+build vn_gen -fprofile-generate vn.c
+check "value numbering, -fprofile-generate" "19 104 14 9 3 11 57 110" "$(run vn_gen)"
+printf 'f B 0 1\nmain B 0 1\n' > scc.prof
+build vn_use -fprofile-use vn.c
+check "value numbering, -fprofile-use" "19 104 14 9 3 11 57 110" "$(run vn_use)"
+
+# if/else assignments lowered to cmov, and the builtins
+cat > cmov.c << 'EOF'
+int g;
+int main() {
+    int a; int b; int m;
+    a = 3; b = 7;
+    if (a > b) m = a; else m = b;
+    printf("%d ", m);
+    if (a < b) m = a; else m = b;
+    printf("%d ", m);
+    if (a == 3) g = 10; else g = 20;
+    printf("%d ", g);
+    if (a > b) m = a + 1; else m = b - 1;
+    printf("%d ", m);
+    printf("%d %d %d %d\n", abs(0 - 5), min(a, 10), max(a, b), strlen("hello"));
+    return 0;
+}
+EOF
+build cmov cmov.c
+check "cmov and builtins" "7 3 10 6 5 3 7 5" "$(run cmov)"
+check "cmov emitted" "yes" "$(grep -qE 'cmov|csel' cmov.s && echo yes)"
+
+# Arguments evaluated into ABI registers, and on the stack past six
+cat > calls.c << 'EOF'
+int g;
+int h(int a, int b, int c, int d, int e, int f, int g2, int h2, int i) {
+    return a + 2*b + 3*c + 4*d + 5*e + 6*f + 7*g2 + 8*h2 + 9*i;
+}
+int id(int x) { return x; }
+int bump() { g = g + 1; return g; }
+int main() {
+    int x;
+    int a[5];
+    x = 3;
+    a[0] = 1; a[1] = 2; a[2] = 3;
+    printf("%d\n", h(1, 2, 3, 4, 5, 6, 7, 8, 9));
+    printf("%d\n", h(id(1), x, a[1], id(4), x + 2, a[2] * 2, id(7), 8, id(9)));
+    printf("%d\n", 100 + h(1, 1, 1, 1, 1, 1, 1, 1, id(1)));
+    x = 1 + id(2) * id(3);
+    printf("%d\n", x);
+    g = 0;
+    printf("%d %d\n", bump(), bump());
+    printf("%d %d %d %d %d %d %d\n", 1, 2, 3, 4, 5, 6, 7);
+    return 0;
+}
+EOF
+build calls calls.c
+check "ABI calls" "285 284 145 7 1 2 1 2 3 4 5 6 7" "$(run calls)"
+
+# Bit-manipulation and atomic intrinsics
+cat > intrin.c << 'EOF'
+int cnt;
+int main() {
+    int x; int e; int d; int r;
+    x = 1000;
+    r = __builtin_popcount(x) * 1000000;
+    r = r + __builtin_ctz(x) * 10000;
+    r = r + __builtin_clz(x) * 100;
+    r = r + __builtin_popcount(255) + __builtin_clz(1);
+    if ((__builtin_bswap64(x) >> 48 & 255) != 3 || __builtin_bswap64(__builtin_bswap64(x)) != x) r = -1;
+    if (__builtin_rotateleft64(x, 4) != 16000) r = -2;
+    if (__builtin_rotateright64(__builtin_rotateleft64(x, x), x) != 1000) r = -3;
+    cnt = 5;
+    if (__atomic_fetch_add(&cnt, 3, __ATOMIC_SEQ_CST) != 5 || cnt != 8) r = -4;
+    e = 8; d = 20;
+    if (!__atomic_compare_exchange_n(&cnt, &e, d, 0, 5, 5) || cnt != 20) r = -5;
+    e = 7;
+    if (__atomic_compare_exchange(&cnt, &e, &d, 0, 5, 5) || e != 20) r = -6;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    x = 0;
+    printf("%d %d %d\n", r, __builtin_clz(x), __builtin_ctz(x));
+    return 0;
+}
+EOF
+build intrin intrin.c
+check "intrinsics" "6035471 64 64" "$(run intrin)"
+build intrin_base -mbaseline intrin.c
+check "intrinsics, -mbaseline" "6035471 64 64" "$(run intrin_base)"
+
+# Structs, alignment, const tables and two-dimensional arrays
+cat > data.c << 'EOF'
+struct point { char tag; int x; int y; };
+struct node { int val; struct point pos; struct node *next; char c; };
+struct node nodes[4];
+int counters[8] __aligned(64);
+const int pow10[] = { 1, 10, 100, 1000, 10000 };
+const char cls[8] = { 'a', 'b', -3 };
+int data[4] = { 4, 3 };
+const int id[][3] = { {1}, {0, 1}, {0, 0, 1} };
+int flat[2][2] = { 5, 6, 7 };
+int sum(struct node *n) {
+    int s;
+    s = 0;
+    while (n) {
+        s = s + n->val + n->pos.x * 10 + n->c;
+        n = n->next;
+    }
+    return s;
+}
+int main() {
+    int m[4][5];
+    int buf[4] __aligned(32);
+    int i; int j; int s;
+    for (i = 0; i < 4; i++) {
+        nodes[i].val = i;
+        nodes[i].pos.x = i * 2;
+        nodes[i].c = 1;
+        if (i < 3) nodes[i].next = &nodes[i + 1]; else nodes[i].next = 0;
+        for (j = 0; j < 5; j++) m[i][j] = i * 10 + j;
+    }
+    printf("%d %d %d\n", sum(&nodes[0]), sizeof(struct node), offsetof(struct node, pos.y));
+    printf("%d %d\n", (&counters[0] & 63) + (&buf[0] & 31), pow10[3] + cls[0] + cls[2] + data[1]);
+    s = 0;
+    for (i = 0; i < 3; i++) s += id[i][i];
+    printf("%d %d %d\n", m[3][4] + m[1][2], s + flat[1][0], sizeof(m));
+    return 0;
+}
+EOF
+build data data.c
+check "structs and tables" "130 48 24 0 1097 46 10 160" "$(run data)"
+
+# String-initialized char arrays are packed, so they need a size
+cat > str.c << 'EOF'
+char name[6] = "hello";
+int main() {
+    puts(name);
+    return 0;
+}
+EOF
+build str str.c
+check "string initializer" "hello" "$(run str)"
+echo 'char msg[] = "hey";' > str2.c
+check "string initializer without size" "str2.c:1: Error: Array size needed for a string initializer" "$(./scc_enhanced str2.c 2>&1 > /dev/null | head -1)"
+
+# Declarations at the start of any block
+cat > blocks.c << 'EOF'
+int x = 100;
+int f(int n) {
+    int s = 0;
+    if (n > 0) {
+        int buf[64];
+        int i = 0;
+        while (i < 64) {
+            buf[i] = i;
+            i++;
+        }
+        s = buf[63] + buf[1];
+    } else {
+        int other[64];
+        other[5] = 9;
+        s = other[5];
+    }
+    {
+        int x = 5;
+        {
+            int x = 7;
+            s += x;
+        }
+        s += x;
+    }
+    return s + x + n;
+}
+int main() {
+    printf("%d %d\n", f(1), f(0));
+    return 0;
+}
+EOF
+build blocks blocks.c
+check "block declarations" "177 121" "$(run blocks)"
+
+# -whole: two units as one program, with calls inlined across them
+cat > util.c << 'EOF'
+int scale = 3;
+int limit = 100;
+int counter;
+int sq(int x) { return x * x; }
+int clampadd(int a, int b) { return a + b + (a < b) * limit; }
+int times(int v) { return v * scale; }
+int unused(int z) { return z + 1; }
+int bump(int d) {
+    counter += d;
+    return counter;
+}
+EOF
+cat > main.c << 'EOF'
+int main() {
+    int x = 4;
+    int y = 5;
+    printf("%d %d ", sq(x) + sq(y + 1), clampadd(y, x) + clampadd(90, 20));
+    printf("%d %d\n", times(sq(2)), bump(2) + bump(3));
+    return 0;
+}
+EOF
+build whole -whole util.c main.c
+check "-whole" "52 119 12 7" "$(run whole)"
+./scc-driver -o driven util.c main.c > /dev/null
+check "scc-driver" "52 119 12 7" "$(run driven)"
+check "scc-driver without main" "Error: main function not defined" "$(./scc-driver -o nomain util.c 2>&1)"
+echo 'int scale;' > dup.c
+check "-whole duplicate global" "dup.c:1: Error: Duplicate symbol definition" "$(./scc_enhanced -whole util.c dup.c main.c 2>&1 > /dev/null | head -1)"
+
+# -fprofile-generate counters, and -fprofile-use laying out by them
+cat > prof.c << 'EOF'
+int errs;
+int fail(int code) { errs = errs + code; return code; }
+int never() { printf("999\n"); return 0; }
+int main() {
+    int i; int s; int t;
+    i = 0; s = 0; t = 0;
+    while (i < 100) {
+        if (i == 57) {
+            fail(1);
+            t = t + 3;
+        }
+        if (i > 1000) {
+            fail(2);
+        }
+        if (i & 3) {
+            s = s + 1;
+            t = t + 1;
+        } else {
+            s = s + 10;
+        }
+        if (i < 90 && i > 2) t = t + 1; else s = s + 2;
+        i++;
+    }
+    printf("%d %d %d\n", s, t, errs);
+    return 0;
+}
+EOF
+rm -f scc.prof
+build prof_gen -fprofile-generate prof.c
+check "-fprofile-generate" "351 165 1" "$(run prof_gen)"
+check "-fprofile-generate counts" "main B 0 1 fail B 0 1" "$(grep -E '^(main|fail) B 0 ' scc.prof | sort -r | tr '\n' ' ' | sed 's/ $//')"
+build prof_use -fprofile-use prof.c
+check "-fprofile-use" "351 165 1" "$(run prof_use)"
+check "-fprofile-use cold code" "2" "$(grep -A2 'text.unlikely' prof_use.s | grep -cE 'globl never$|type main.cold,')"
+
+# -g line tables, linked by sld_enhanced
+cat > dbg.c << 'EOF'
+int sq(int x) { return x * x; }
+int main() {
+    int i; int s;
+    s = 0;
+    for (i = 1; i <= 4; i++) s = s + sq(i);
+    printf("%d\n", s);
+    return 0;
+}
+EOF
+./scc_enhanced -g dbg.c > dbg.s && as dbg.s -o dbg.o &&
+    ./sld_enhanced -o dbg syscall_linux_${ARCH}.o runtime.o dbg.o > /dev/null
+chmod +x dbg 2>/dev/null || true
+check "-g with sld_enhanced" "30" "$(run dbg)"
+check "-g line table" "yes" "$(grep -q 'debug_line' dbg && echo yes)"
+
+# .stack_sizes and sstack
+cat > stack.c << 'EOF'
+int leaf(int a) { int buf[10]; buf[0] = a; return buf[0]; }
+int mid(int a) { return leaf(a) + leaf(a + 1); }
+int rec(int n) { if (n) return rec(n - 1); return 0; }
+int main() { int x; x = mid(3) + rec(3); return x; }
+EOF
+./scc_enhanced -fstack-size-section stack.c > stack.s && as stack.s -o stack.o
+check "sstack" "Worst case from main: 216 bytes  recursive" "$(./sstack stack.o | grep 'Worst case')"
+
+# Units compiled on their own, where only one defines main
+./scc_enhanced -fstack-usage -fstack-size-section util.c > util.s && as util.s -o util.o
+./scc_enhanced -fstack-usage -fstack-size-section main.c > main.s && as main.s -o main.o
+ld -static syscall_linux_${ARCH}.o runtime.o util.o main.o -o units 2>/dev/null || true
+check "separate units" "52 119 12 7" "$(run units)"
+check "stack usage of a unit without main" "util.c:4:sq" "$(head -1 util.su | cut -f1)"
+check "sstack across objects" "Worst case from main: 96 bytes  incomplete" "$(./sstack util.o main.o | grep 'Worst case')"
+rm -f scc.prof
+./scc_enhanced -fprofile-generate util.c > util.s && as util.s -o util.o
+./scc_enhanced -fprofile-generate main.c > main.s && as main.s -o main.o
+ld -static syscall_linux_${ARCH}.o runtime.o util.o main.o -o units_gen 2>/dev/null || true
+check "-fprofile-generate, separate units" "52 119 12 7" "$(run units_gen)"
+check "-fprofile-generate counts, separate units" "sq B 0 3 main B 0 1" "$(grep -E '^(main|sq) B 0 ' scc.prof | sort -r | tr '\n' ' ' | sed 's/ $//')"
+
+cd ..
+if [ $FAILED -ne 0 ]; then
+    echo -e "${RED}$FAILED regression tests failed${NC}"
+    exit 1
+fi
+rm -rf regress
+echo ""
+
 # Build everything
 echo "Building compilers and runtime..."
 make clean >/dev/null 2>&1 || true